@@ -1,24 +1,132 @@
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ScopeExit.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/IRMover.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "llvm/Transforms/Vectorize.h"
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
 #include <string>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
+using namespace llvm;
+
+//------------------------------------- Pipeline Queues ------------------------------------------
+
+// BoundedQueue - a blocking FIFO between pipeline stages. push blocks while the
+// queue is full, which throttles a fast producer to its consumer's pace.
+template <typename T>
+class BoundedQueue {
+  std::mutex Lock;
+  std::condition_variable NotEmpty, NotFull;
+  std::deque<T> Items;
+  size_t Capacity;
+  bool Closed = false;
+
+  public:
+    explicit BoundedQueue(size_t Capacity) : Capacity(Capacity) {}
+
+    void push(T Item) {
+      std::unique_lock<std::mutex> L(Lock);
+      NotFull.wait(L, [this] { return Items.size() < Capacity; });
+      Items.push_back(std::move(Item));
+      NotEmpty.notify_one();
+    }
+
+    // close - no more pushes; pop drains what is left and then returns false.
+    void close() {
+      std::lock_guard<std::mutex> L(Lock);
+      Closed = true;
+      NotEmpty.notify_all();
+    }
+
+    bool pop(T &Item) {
+      std::unique_lock<std::mutex> L(Lock);
+      NotEmpty.wait(L, [this] { return !Items.empty() || Closed; });
+      if (Items.empty())
+        return false;
+      Item = std::move(Items.front());
+      Items.pop_front();
+      NotFull.notify_one();
+      return true;
+    }
+};
+
+// InputBlocks - ring of input buffers filled by the reader thread (-pipeline).
+static std::unique_ptr<BoundedQueue<std::string>> InputBlocks;
+// CompileQueue - compile steps of parsed top-level items, run on the compile thread (-pipeline).
+static std::unique_ptr<BoundedQueue<std::function<void()>>> CompileQueue;
+
 //---------------------------------------- Lexer -------------------------------------------------
 
 enum Token {
@@ -27,31 +135,50 @@ enum Token {
   //commands 
   tok_def = -2,
   tok_extern = -3,
+  tok_const = -6,
+  tok_export = -7,
+  tok_grad = -8,
+  tok_table = -9,
+  tok_import = -10,
 
   //primary
   tok_identifier = -4,
   tok_number = -5,
+  tok_string = -11,
 };
 
-static std::string IdentifierStr; // filled in if tok_identifier
-static double NumVal;             // filled in if tok_number.
+// the lexer and parser state is per thread, so -project can parse files in parallel.
+static thread_local std::string IdentifierStr; // filled in if tok_identifier or tok_string.
+static thread_local double NumVal;             // filled in if tok_number.
 
-// gettok - Return the next token from tandard input.
-static int gettok() {
-  static int LastChar = ' ';
-  
+// lexToken - Return the next token from NextChar, a callable yielding one character
+// per call (EOF at the end). LastChar carries the lookahead between calls, so each
+// input being lexed needs its own.
+template <typename CharSource>
+static int lexToken(CharSource &NextChar, int &LastChar, std::string &Ident,
+    double &Num) {
   while (isspace(LastChar)) // skip whitespace.
-    LastChar = getchar();
+    LastChar = NextChar();
 
   if (isalpha(LastChar)) {  // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum(LastChar = getchar()))
-      IdentifierStr += LastChar;
+    Ident = LastChar;
+    while (isalnum(LastChar = NextChar()))
+      Ident += LastChar;
     
-    if (IdentifierStr == "def")
+    if (Ident == "def")
       return tok_def;
-    if (IdentifierStr == "extern")
+    if (Ident == "extern")
       return tok_extern;
+    if (Ident == "const")
+      return tok_const;
+    if (Ident == "export")
+      return tok_export;
+    if (Ident == "grad")
+      return tok_grad;
+    if (Ident == "table")
+      return tok_table;
+    if (Ident == "import")
+      return tok_import;
     
     return tok_identifier;
   }
@@ -59,29 +186,129 @@ static int gettok() {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = NextChar();
     } while (isdigit(LastChar) || LastChar == '.');
 
-    NumVal = strtod(NumStr.c_str(), 0);
+    Num = strtod(NumStr.c_str(), 0);
     return tok_number;
   }
+  if (LastChar == '"') { // string: '"' [^"\n]* '"'
+    Ident.clear();
+    while ((LastChar = NextChar()) != '"' && LastChar != EOF && LastChar != '\n')
+      Ident += LastChar;
+    if (LastChar == '"')
+      LastChar = NextChar();
+    return tok_string;
+  }
   if (LastChar == '#') {  // Comment until end of line 
     do 
-      LastChar = getchar();
+      LastChar = NextChar();
     while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if (LastChar != EOF)
-      return gettok();
+      return lexToken(NextChar, LastChar, Ident, Num);
   }
   if (LastChar == EOF)
     return tok_eof;
 
   // otherwise, just return the character as its ascii value.
   int thisChar = LastChar;
-  LastChar = getchar();
+  LastChar = NextChar();
   return thisChar;
 }
 
+// LexedToken - one token of a pre-lexed stream, with the value gettok would have set.
+struct LexedToken {
+  int Tok;
+  std::string IdentifierStr;
+  double NumVal;
+};
+
+// lexRange - lex [Begin, End) into Tokens, without a trailing tok_eof.
+static void lexRange(const char *Begin, const char *End,
+    std::vector<LexedToken> &Tokens) {
+  const char *Cur = Begin;
+  auto NextChar = [&Cur, End]() -> int {
+    return Cur == End ? EOF : (unsigned char)*Cur++;
+  };
+
+  int LastChar = ' ';
+  LexedToken T{tok_eof, "", 0};
+  while ((T.Tok = lexToken(NextChar, LastChar, T.IdentifierStr, T.NumVal)) != tok_eof)
+    Tokens.push_back(T);
+}
+
+// lexParallel - lex a whole buffer on several threads.
+//
+// The buffer is cut into chunks that each start at the beginning of a line. No
+// token and no '#' comment spans a newline, so every chunk starts in the
+// lexer's initial state and the per-chunk streams concatenate into exactly
+// the stream a sequential lex would produce; no chunk ever needs re-lexing.
+static std::vector<LexedToken> lexParallel(const std::string &Buf,
+    unsigned NumThreads) {
+  const size_t MinChunkSize = 1 << 16; // not worth a thread below this.
+  size_t ChunkSize = std::max(MinChunkSize, Buf.size() / std::max(NumThreads, 1u));
+
+  std::vector<std::pair<const char *, const char *>> Chunks;
+  const char *Begin = Buf.data(), *End = Buf.data() + Buf.size();
+  while (Begin != End) {
+    const char *Split = End;
+    if ((size_t)(End - Begin) > ChunkSize) {
+      Split = std::find(Begin + ChunkSize, End, '\n');
+      if (Split != End)
+        ++Split; // keep the newline in this chunk.
+    }
+    Chunks.push_back({Begin, Split});
+    Begin = Split;
+  }
+
+  std::vector<std::vector<LexedToken>> ChunkTokens(Chunks.size());
+  std::vector<std::thread> Workers;
+  for (size_t i = 0; i != Chunks.size(); ++i)
+    Workers.emplace_back([&, i] {
+      lexRange(Chunks[i].first, Chunks[i].second, ChunkTokens[i]);
+    });
+  for (auto &W : Workers)
+    W.join();
+
+  std::vector<LexedToken> Tokens;
+  for (auto &CT : ChunkTokens)
+    std::move(CT.begin(), CT.end(), std::back_inserter(Tokens));
+  Tokens.push_back({tok_eof, "", 0});
+  return Tokens;
+}
+
+// PreLexedTokens - when non-empty, gettok reads from here instead of standard input (-parallel-lex).
+static thread_local std::vector<LexedToken> PreLexedTokens;
+static thread_local size_t PreLexedPos = 0;
+
+// gettok - Return the next token from tandard input.
+static int gettok() {
+  if (!PreLexedTokens.empty()) {
+    const LexedToken &T = PreLexedTokens[PreLexedPos];
+    if (T.Tok != tok_eof)
+      ++PreLexedPos;
+    IdentifierStr = T.IdentifierStr;
+    NumVal = T.NumVal;
+    return T.Tok;
+  }
+
+  static int LastChar = ' ';
+  static std::string Block; // current input block when pipelined.
+  static size_t BlockPos = 0;
+  auto NextChar = []() -> int {
+    if (!InputBlocks)
+      return getchar();
+    while (BlockPos == Block.size()) {
+      if (!InputBlocks->pop(Block))
+        return EOF;
+      BlockPos = 0;
+    }
+    return (unsigned char)Block[BlockPos++];
+  };
+  return lexToken(NextChar, LastChar, IdentifierStr, NumVal);
+}
+
 //------------------------------------------- Parse Tree.---------------------------------------
 
 namespace {
@@ -90,6 +317,23 @@ class ExprAST {
   public:
     virtual ~ExprAST() = default;
     virtual Value *codegen() = 0;
+    virtual std::unique_ptr<ExprAST> clone() const = 0;
+
+    // evaluate - fold the expression to a double without going through codegen.
+    // returns false if the expression is not a compile-time constant.
+    virtual bool evaluate(double &) const { return false; }
+
+    // collectCallees - append the name of every function this expression calls.
+    virtual void collectCallees(std::vector<std::string> &) const {}
+
+    // collectVariables - append the name of every variable this expression reads.
+    virtual void collectVariables(std::vector<std::string> &) const {}
+
+    // appendStructure - append a canonical encoding of the expression to Out, with
+    // parameters encoded by position so that equal strings mean structurally
+    // identical bodies modulo argument names.
+    virtual void appendStructure(std::string &Out,
+        const std::map<std::string, unsigned> &Params) const = 0;
 };
 
 //NumberExprAST <---> Expression class for all numeric literals.
@@ -98,6 +342,13 @@ class NumberExprAST : public ExprAST {
   public:
     NumberExprAST(double Val) : Val(Val) {}
     Value *codegen() override;
+    std::unique_ptr<ExprAST> clone() const override {
+      return std::make_unique<NumberExprAST>(Val);
+    }
+    double getVal() const { return Val; }
+    bool evaluate(double &Result) const override;
+    void appendStructure(std::string &Out,
+        const std::map<std::string, unsigned> &Params) const override;
 };   
 
 class VariableExprAST : public ExprAST { // Expression class for  referencing 
@@ -105,6 +356,17 @@ class VariableExprAST : public ExprAST { // Expression class for  referencing
   std::string Name;
   public:
     VariableExprAST(const std::string &Name) : Name(Name) {}
+    Value *codegen() override;
+    std::unique_ptr<ExprAST> clone() const override {
+      return std::make_unique<VariableExprAST>(Name);
+    }
+    const std::string &getName() const { return Name; }
+    bool evaluate(double &Result) const override;
+    void collectVariables(std::vector<std::string> &Names) const override {
+      Names.push_back(Name);
+    }
+    void appendStructure(std::string &Out,
+        const std::map<std::string, unsigned> &Params) const override;
 };
 
 class BinaryExprAST : public ExprAST { // expression class for a binary operator.
@@ -114,6 +376,24 @@ class BinaryExprAST : public ExprAST { // expression class for a binary operator
   public:
     BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, 
         std::unique_ptr<ExprAST> RHS) : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    Value *codegen() override;
+    std::unique_ptr<ExprAST> clone() const override {
+      return std::make_unique<BinaryExprAST>(Op, LHS->clone(), RHS->clone());
+    }
+    char getOp() const { return Op; }
+    const ExprAST *getLHS() const { return LHS.get(); }
+    const ExprAST *getRHS() const { return RHS.get(); }
+    bool evaluate(double &Result) const override;
+    void collectCallees(std::vector<std::string> &Callees) const override {
+      LHS->collectCallees(Callees);
+      RHS->collectCallees(Callees);
+    }
+    void collectVariables(std::vector<std::string> &Names) const override {
+      LHS->collectVariables(Names);
+      RHS->collectVariables(Names);
+    }
+    void appendStructure(std::string &Out,
+        const std::map<std::string, unsigned> &Params) const override;
 };
 
 
@@ -124,17 +404,53 @@ class CallExprAST : public ExprAST { // expression class for function calls.
   public:
     CallExprAST(const std::string &Callee, 
         std::vector<std::unique_ptr<ExprAST>> Args) : Callee(Callee), Args(std::move(Args)) {}
+    Value *codegen() override;
+    std::unique_ptr<ExprAST> clone() const override {
+      std::vector<std::unique_ptr<ExprAST>> ArgsCopy;
+      for (auto &Arg : Args)
+        ArgsCopy.push_back(Arg->clone());
+      return std::make_unique<CallExprAST>(Callee, std::move(ArgsCopy));
+    }
+    const std::string &getCallee() const { return Callee; }
+    const std::vector<std::unique_ptr<ExprAST>> &getArgs() const { return Args; }
+    bool evaluate(double &Result) const override;
+    void collectCallees(std::vector<std::string> &Callees) const override {
+      Callees.push_back(Callee);
+      for (auto &Arg : Args)
+        Arg->collectCallees(Callees);
+    }
+    void collectVariables(std::vector<std::string> &Names) const override {
+      for (auto &Arg : Args)
+        Arg->collectVariables(Names);
+    }
+    void appendStructure(std::string &Out,
+        const std::map<std::string, unsigned> &Params) const override;
 };
 
 class PrototypeAST { // prototype of a function captures it's name and arguments.
   std::string Name;
   std::vector<std::string> Args;
+  bool Exported = false; // 'export def': keeps external linkage and the C calling convention.
+  bool HasTable = false;  // 'table(lo, hi)': precomputed for the integers in [TableLo, TableHi].
+  int TableLo = 0, TableHi = 0;
 
   public:
     PrototypeAST(const std::string &Name, 
         std::vector<std::string> Args) : Name(Name), Args(std::move(Args)) {}
 
+    Function *codegen();
     const std::string &getName() const { return Name; }
+    const std::vector<std::string> &getArgs() const { return Args; }
+    bool isExported() const { return Exported; }
+    void setExported() { Exported = true; }
+    bool hasTable() const { return HasTable; }
+    int getTableLo() const { return TableLo; }
+    int getTableHi() const { return TableHi; }
+    void setTable(int Lo, int Hi) {
+      HasTable = true;
+      TableLo = Lo;
+      TableHi = Hi;
+    }
 };
 
 class FunctionAST { // This class represents a function definition itself.
@@ -145,16 +461,43 @@ class FunctionAST { // This class represents a function definition itself.
     FunctionAST(std::unique_ptr<PrototypeAST> Proto,
         std::unique_ptr<ExprAST> Body)
       : Proto(std::move(Proto)), Body(std::move(Body)) {} 
+
+    Function *codegen();
+    const PrototypeAST *getProto() const { return Proto.get(); }
+    const ExprAST *getBody() const { return Body.get(); }
+    void setBody(std::unique_ptr<ExprAST> NewBody) { Body = std::move(NewBody); }
 };
 }
 
 //-------------------------------------- Parser. ----------------------------------------------
-static int CurTok;
+static thread_local int CurTok;
 static std::unique_ptr<ExprAST> ParseExpression();
 static int getNextToken() {
   return CurTok = gettok();
 }
 
+// ParseTokens - run Parse with the lexer reading Tokens, then resume the
+// input where it left off.
+static void ParseTokens(std::vector<LexedToken> Tokens, const std::function<void()> &Parse) {
+  std::vector<LexedToken> SavedTokens = std::move(PreLexedTokens);
+  size_t SavedPos = PreLexedPos;
+  int SavedTok = CurTok;
+  std::string SavedIdentifier = IdentifierStr;
+  double SavedNum = NumVal;
+
+  PreLexedTokens = std::move(Tokens);
+  PreLexedTokens.push_back({tok_eof, "", 0});
+  PreLexedPos = 0;
+  getNextToken();
+  Parse();
+
+  PreLexedTokens = std::move(SavedTokens);
+  PreLexedPos = SavedPos;
+  CurTok = SavedTok;
+  IdentifierStr = SavedIdentifier;
+  NumVal = SavedNum;
+}
+
 // LogError - These are helper function for error handling.
 std::unique_ptr<ExprAST> LogError(const char *Str) {
   fprintf(stderr, "Error: %s\n", Str);
@@ -169,7 +512,7 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
 static std::unique_ptr<ExprAST> ParseNumberExpr() {
   auto result = std::make_unique<NumberExprAST>(NumVal);
   getNextToken();
-  return std::move(result);
+  return result;
 }
 
 static std::unique_ptr<ExprAST> ParseParenExpr() {
@@ -183,6 +526,8 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   return V;
 }
 
+static void RequirePrelude(const std::string &Name);
+
 static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   std::string IdName = IdentifierStr;
 
@@ -210,6 +555,7 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 
   //eat ')' token.
   getNextToken();
+  RequirePrelude(IdName);
   return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
@@ -233,9 +579,10 @@ static int GetTokPrecedence()
   if (!isascii(CurTok))
     return -1;
 
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0) return -1;
-  return TokPrec;
+  // find, not [], so that parsing never writes to the table.
+  auto Op = BinopPrecedence.find(CurTok);
+  if (Op == BinopPrecedence.end() || Op->second <= 0) return -1;
+  return Op->second;
 }
 
 static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, 
@@ -277,11 +624,15 @@ static std::unique_ptr<ExprAST> ParseExpression() {
   return ParseBinOpRHS(0, std::move(LHS));
 }
 
+// ParsedFunctions - every name a prototype has given so far; these hide prelude helpers.
+static thread_local std::set<std::string> ParsedFunctions;
+
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (CurTok != tok_identifier)
     return LogErrorP("Expected function name in prototype.");
 
   std::string fnName = IdentifierStr; // function name. 
+  ParsedFunctions.insert(fnName);
   getNextToken();   
 
   if (CurTok != '(')
@@ -299,17 +650,107 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   return std::make_unique<PrototypeAST>(fnName, std::move(ArgNames));
 }
 
+// MaxTableSize - most entries a 'table' annotation may ask for.
+static const int MaxTableSize = 1 << 16;
+
+// tableannot ::= 'table' '(' bound ',' bound ')'
+// bound ::= '-'? number
+static bool ParseTableAnnotation(PrototypeAST &Proto) {
+  getNextToken(); // consume 'table'.
+  if (CurTok != '(') {
+    LogError("Expected '(' after 'table'.");
+    return false;
+  }
+  double Bounds[2];
+  for (int i = 0; i != 2; ++i) {
+    bool Negative = getNextToken() == '-';
+    if (Negative)
+      getNextToken(); // consume '-'.
+    // range-check before the conversion, which is undefined outside int.
+    if (CurTok != tok_number || NumVal > INT_MAX || NumVal != (int)NumVal) {
+      LogError("Expected integer bound in 'table'.");
+      return false;
+    }
+    Bounds[i] = Negative ? -NumVal : NumVal;
+    if (getNextToken() != (i == 0 ? ',' : ')')) {
+      LogError(i == 0 ? "Expected ',' in 'table'." : "Expected ')' in 'table'.");
+      return false;
+    }
+  }
+  getNextToken(); // consume ')'.
+
+  if (Proto.getArgs().size() != 1) {
+    LogError("'table' needs a def with exactly one parameter.");
+    return false;
+  }
+  if (Bounds[0] > Bounds[1] || Bounds[1] - Bounds[0] >= MaxTableSize) {
+    LogError("'table' range is empty or too large.");
+    return false;
+  }
+  Proto.setTable(Bounds[0], Bounds[1]);
+  return true;
+}
+
+// definition ::= 'export'? 'def' prototype tableannot? expression
 static std::unique_ptr<FunctionAST> ParseDefinition() {
-  getNextToken();
+  bool Exported = CurTok == tok_export;
+  if (Exported && getNextToken() != tok_def) {
+    LogError("Expected 'def' after 'export'.");
+    return nullptr;
+  }
+  getNextToken(); // consume 'def'.
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
+  if (Exported)
+    Proto->setExported();
+  if (CurTok == tok_table && !ParseTableAnnotation(*Proto))
+    return nullptr;
 
   if (auto E = ParseExpression())
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
   return nullptr;
 }
 
+// constdef ::= 'const' identifier '=' expression
+static std::unique_ptr<ExprAST> ParseConstDefinition(std::string &Name) {
+  getNextToken(); // consume 'const'.
+  if (CurTok != tok_identifier)
+    return LogError("Expected constant name after 'const'.");
+
+  Name = IdentifierStr;
+  getNextToken();
+
+  if (CurTok != '=')
+    return LogError("Expected '=' in constant definition.");
+  getNextToken(); // consume '='.
+
+  return ParseExpression();
+}
+
+// gradient ::= 'grad' identifier
+static bool ParseGrad(std::string &Name) {
+  getNextToken(); // consume 'grad'.
+  if (CurTok != tok_identifier) {
+    LogError("Expected function name after 'grad'.");
+    return false;
+  }
+  Name = IdentifierStr;
+  getNextToken();
+  return true;
+}
+
+// import ::= 'import' string
+static bool ParseImport(std::string &Path) {
+  if (getNextToken() != tok_string) { // consume 'import'.
+    LogError("Expected a file name in quotes after 'import'.");
+    return false;
+  }
+  Path = IdentifierStr;
+  getNextToken();
+  return true;
+}
+
 static std::unique_ptr<PrototypeAST> ParseExtern() {
   getNextToken();        
   return ParsePrototype();
@@ -324,20 +765,119 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr()
   return nullptr;
 }
 
+// ConstantValues - compile-time values of 'const' definitions, inlined at every reference.
+static std::map<std::string, double> ConstantValues;
+// FunctionDefs - parsed 'def's, kept so the constant evaluator can interpret calls.
+static std::map<std::string, std::shared_ptr<FunctionAST>> FunctionDefs;
+
+// BatchMode - defer defs and top-level expressions to end of input and compile
+// them in call-graph order (-batch). The defs to compile are FunctionDefs.
+static bool BatchMode = false;
+static std::vector<std::shared_ptr<FunctionAST>> BatchEntries;
+// MergedDefs - batch defs folded into a structurally identical def: name -> implementation.
+static std::map<std::string, std::string> MergedDefs;
+
+// UseJIT - compile each def and top-level expression into its own module, load
+// it into the JIT and run the expressions (-jit).
+static bool UseJIT = false;
+// NumExecutors - with -jit, child processes to run top-level expressions in,
+// instead of in the compiler (-executors=N).
+static unsigned NumExecutors = 0;
+// ProjectBuild - compile a tree of files joined by 'import' to an object per file (-project=FILE).
+static bool ProjectBuild = false;
+// ExternProtos - declared externs, for redeclaring them in later modules with
+// -jit. Defs restored from a session snapshot are here too: the JIT has their
+// code, but there is no AST for them.
+static std::map<std::string, std::shared_ptr<PrototypeAST>> ExternProtos;
+
+// ResolveMergedDef - the name of the def that actually implements Name.
+static std::string ResolveMergedDef(std::string Name) {
+  for (auto I = MergedDefs.find(Name); I != MergedDefs.end(); I = MergedDefs.find(Name))
+    Name = I->second;
+  return Name;
+}
+
+static void RunASTPasses(FunctionAST &Fn);
+static void JITDefinition(Function *F);
+static void JITTopLevelExpr(Function *F);
+
+// RunCompileStep - run the compile step of a parsed item, or queue it for the
+// compile thread when pipelined. Compile steps own all module and symbol state;
+// parsing only reads BinopPrecedence.
+static void RunCompileStep(std::function<void()> Step) {
+  if (CompileQueue)
+    CompileQueue->push(std::move(Step));
+  else
+    Step();
+}
+
+// CompileDefinition - compile step shared by parsed and generated defs.
+static void CompileDefinition(std::shared_ptr<FunctionAST> FnAST) {
+  RunASTPasses(*FnAST);
+  FunctionDefs[FnAST->getProto()->getName()] = FnAST;
+  if (BatchMode)
+    return; // compiled at end of input.
+  if (auto *FnIR = FnAST->codegen()) {
+    FnIR->print(errs());
+    if (UseJIT)
+      JITDefinition(FnIR);
+  }
+}
+
 static void HandleDefinition()
 {
-  if (ParseDefinition()) {
-    fprintf(stderr, "Parsed a function definition.\n");
+  if (std::shared_ptr<FunctionAST> FnAST = ParseDefinition()) {
+    RunCompileStep([FnAST] {
+      fprintf(stderr, "Parsed a function definition.\n");
+      CompileDefinition(FnAST);
+    });
   } else {
     // Skip token for error recovery.
     getNextToken();
   }
 }
 
+static void HandleConstDefinition()
+{
+  std::string Name;
+  if (std::shared_ptr<ExprAST> Init = ParseConstDefinition(Name)) {
+    RunCompileStep([Name, Init] {
+      double Val;
+      if (!Init->evaluate(Val)) {
+        LogError("const initializer is not a compile-time constant.");
+        return;
+      }
+      ConstantValues[Name] = Val;
+      fprintf(stderr, "Defined const %s = %f\n", Name.c_str(), Val);
+    });
+  } else {
+    // skip token for error recovery.
+    getNextToken();
+  }
+}
+
+static bool GenerateGradient(const std::string &Name);
+
+static void HandleGrad()
+{
+  std::string Name;
+  if (ParseGrad(Name)) {
+    RunCompileStep([Name] { GenerateGradient(Name); });
+  } else {
+    // skip token for error recovery.
+    getNextToken();
+  }
+}
+
 static void HandleExtern()
 {
-  if (ParseExtern()) {
-    fprintf(stderr, "Parsed an extern\n");
+  if (std::shared_ptr<PrototypeAST> ProtoAST = ParseExtern()) {
+    RunCompileStep([ProtoAST] {
+      fprintf(stderr, "Parsed an extern\n");
+      ExternProtos[ProtoAST->getName()] = ProtoAST;
+      if (auto *FnIR = ProtoAST->codegen())
+        FnIR->print(errs());
+    });
   } else {
     // skip token for error recovery.
     getNextToken();
@@ -346,14 +886,85 @@ static void HandleExtern()
 
 static void HandleTopLevelExpression()
 {
-  if (ParseTopLevelExpr()) {
-    fprintf(stderr, "Parsed a top-level expr\n");
+  if (std::shared_ptr<FunctionAST> FnAST = ParseTopLevelExpr()) {
+    RunCompileStep([FnAST] {
+      // fast path: constant expressions are folded directly, no module, codegen or JIT.
+      double Result;
+      if (FnAST->getBody()->evaluate(Result)) {
+        fprintf(stderr, "Evaluated to %f\n", Result);
+        return;
+      }
+      fprintf(stderr, "Parsed a top-level expr\n");
+      RunASTPasses(*FnAST);
+      if (BatchMode) {
+        BatchEntries.push_back(FnAST);
+        return;
+      }
+      if (auto *FnIR = FnAST->codegen()) {
+        FnIR->print(errs());
+        if (UseJIT)
+          JITTopLevelExpr(FnIR);
+      }
+    });
   } else {
     //skip token for error recovery.
     getNextToken();
   }
 }
 
+// ImportedFiles - files already read by 'import'; each is read once.
+static std::set<std::string> ImportedFiles;
+// ImportDir - directory of the file being read, which its imports are relative to.
+static std::string ImportDir = ".";
+
+// ResolveImport - the path of the file that 'import "Path"' names, from a file in Dir.
+static std::string ResolveImport(StringRef Dir, StringRef Path) {
+  SmallString<256> Full;
+  if (!sys::path::is_absolute(Path))
+    Full = Dir;
+  sys::path::append(Full, Path);
+  sys::path::remove_dots(Full, true);
+  return Full.str().str();
+}
+
+static void MainLoop();
+
+// HandleImport - read the items of the imported file as if they stood in place
+// of the import. -project instead compiles each file on its own.
+static void HandleImport()
+{
+  std::string Path;
+  if (!ParseImport(Path)) {
+    // skip token for error recovery.
+    getNextToken();
+    return;
+  }
+  Path = ResolveImport(ImportDir, Path);
+  if (!ImportedFiles.insert(Path).second)
+    return;
+  auto Buf = MemoryBuffer::getFile(Path);
+  if (!Buf) {
+    fprintf(stderr, "Error: could not read %s: %s\n", Path.c_str(), Buf.getError().message().c_str());
+    return;
+  }
+
+  std::vector<LexedToken> Tokens;
+  lexRange((*Buf)->getBufferStart(), (*Buf)->getBufferEnd(), Tokens);
+  std::string SavedDir = ImportDir;
+  ImportDir = sys::path::parent_path(Path).str();
+  if (ImportDir.empty())
+    ImportDir = ".";
+  ParseTokens(std::move(Tokens), MainLoop);
+  ImportDir = SavedDir;
+}
+
+// SinglePass - emit IR straight from the token stream instead of building an AST (-single-pass).
+static bool SinglePass = false;
+static void HandleDefinitionDirect();
+static void HandleExternDirect();
+static void HandleConstDefinitionDirect();
+static void HandleTopLevelExpressionDirect();
+
 static void MainLoop() 
 {
   while (true) {
@@ -365,23 +976,523 @@ static void MainLoop()
         getNextToken();
         break;
       case tok_def:
-        HandleDefinition();
+      case tok_export:
+        if (SinglePass)
+          HandleDefinitionDirect();
+        else
+          HandleDefinition();
         break;
       case tok_extern:
-        HandleExtern();
+        if (SinglePass)
+          HandleExternDirect();
+        else
+          HandleExtern();
+        break;
+      case tok_const:
+        if (SinglePass)
+          HandleConstDefinitionDirect();
+        else
+          HandleConstDefinition();
+        break;
+      case tok_import:
+        HandleImport();
+        break;
+      case tok_grad:
+        if (SinglePass) {
+          LogError("'grad' needs the AST and is not available with -single-pass.");
+          getNextToken();
+        } else {
+          HandleGrad();
+        }
         break;
       default:
-        HandleTopLevelExpression();
+        if (SinglePass)
+          HandleTopLevelExpressionDirect();
+        else
+          HandleTopLevelExpression();
         break;
     }
   }
 }
 
+// ---------------------------- Prelude. ------------------------------------------
+
+// UsePrelude - let programs call the helpers below without defining them (-no-prelude turns it off).
+static bool UsePrelude = true;
+
+// Prelude - common math helpers, in Kaleidoscope, with the extern each needs,
+// if any. '<' gives 0 or 1, which stands in for the conditionals the language
+// does not have yet. Selecting that way multiplies the unselected value by 0,
+// which is NaN for an infinity, so min, max and abs use libm's, which compile
+// to LLVM intrinsics instead.
+static const struct {
+  const char *Name;
+  const char *Source;
+  const char *Extern;
+} Prelude[] = {
+  {"sq", "def sq(x) x*x", nullptr},
+  {"cube", "def cube(x) x*x*x", nullptr},
+  {"mad", "def mad(a b c) a*b + c", nullptr},
+  {"lerp", "def lerp(a b t) a + (b-a)*t", nullptr},
+  {"min", "def min(a b) fmin(a, b)", "extern fmin(a b)"},
+  {"max", "def max(a b) fmax(a, b)", "extern fmax(a b)"},
+  {"abs", "def abs(x) fabs(x)", "extern fabs(x)"},
+  {"sign", "def sign(x) (0<x) - (x<0)", nullptr},
+  {"step", "def step(edge x) 1 - (x<edge)", nullptr},
+  {"clamp", "def clamp(x lo hi) max(lo, min(x, hi))", nullptr},
+  {"smoothstep", "def smoothstep(t) sq(clamp(t, 0, 1)) * (3 - 2*clamp(t, 0, 1))", nullptr},
+  {"dot2", "def dot2(ax ay bx by) ax*bx + ay*by", nullptr},
+  {"dot3", "def dot3(ax ay az bx by bz) ax*bx + ay*by + az*bz", nullptr},
+};
+
+// RequirePrelude - on the first call to the prelude helper Name, when the
+// program has not defined or declared a function of that name itself, parse
+// the helper and queue it to compile ahead of the item that called it, after
+// its extern. A helper that calls another pulls that one in the same way.
+static void RequirePrelude(const std::string &Name) {
+  if (!UsePrelude || ParsedFunctions.count(Name))
+    return;
+  for (auto &Helper : Prelude) {
+    if (Name != Helper.Name)
+      continue;
+
+    if (Helper.Extern) {
+      std::vector<LexedToken> Tokens;
+      lexRange(Helper.Extern, Helper.Extern + strlen(Helper.Extern), Tokens);
+      std::shared_ptr<PrototypeAST> ProtoAST;
+      ParseTokens(std::move(Tokens), [&ProtoAST] { ProtoAST = ParseExtern(); });
+      if (ProtoAST)
+        RunCompileStep([ProtoAST] {
+          ExternProtos[ProtoAST->getName()] = ProtoAST;
+          ProtoAST->codegen();
+        });
+    }
+
+    std::vector<LexedToken> Tokens;
+    lexRange(Helper.Source, Helper.Source + strlen(Helper.Source), Tokens);
+    std::shared_ptr<FunctionAST> FnAST;
+    ParseTokens(std::move(Tokens), [&FnAST] { FnAST = ParseDefinition(); });
+
+    if (FnAST)
+      RunCompileStep([FnAST] {
+        fprintf(stderr, "Loaded prelude %s\n", FnAST->getProto()->getName().c_str());
+        CompileDefinition(FnAST);
+      });
+    return;
+  }
+}
+
+// ---------------------------- Constant Evaluation. ------------------------------
+// These mirror the codegen below exactly so a folded result is bit-identical
+// to what the generated code would compute.
+
+bool NumberExprAST::evaluate(double &Result) const {
+  Result = Val;
+  return true;
+}
+
+// EvalValues - argument bindings of the def currently being interpreted.
+static std::map<std::string, double> EvalValues;
+// EvalParams - parameters in scope with no value, such as those of a def being
+// differentiated. Like EvalValues, they shadow consts of the same name.
+static std::set<std::string> EvalParams;
+static unsigned EvalDepth = 0;
+// there is no conditional yet, so any recursion deeper than this never terminates.
+static const unsigned MaxEvalDepth = 256;
+// EvalSteps - def calls interpreted since the outermost one began. A shallow
+// call tree can still be exponentially wide, so past MaxEvalSteps evaluation
+// gives up and the expression is compiled instead.
+static unsigned EvalSteps = 0;
+static const unsigned MaxEvalSteps = 1 << 16;
+
+bool VariableExprAST::evaluate(double &Result) const {
+  auto Arg = EvalValues.find(Name);
+  if (Arg != EvalValues.end()) {
+    Result = Arg->second;
+    return true;
+  }
+  if (EvalParams.count(Name))
+    return false;
+  auto Const = ConstantValues.find(Name);
+  if (Const != ConstantValues.end()) {
+    Result = Const->second;
+    return true;
+  }
+  return false;
+}
+
+bool BinaryExprAST::evaluate(double &Result) const {
+  double L, R;
+  if (!LHS->evaluate(L) || !RHS->evaluate(R))
+    return false;
+
+  switch (Op) {
+    case '+':
+      Result = L + R;
+      return true;
+    case '-':
+      Result = L - R;
+      return true;
+    case '*':
+      Result = L * R;
+      return true;
+    case '<':
+      // fcmp ult is also true when either operand is NaN.
+      Result = !(L >= R) ? 1.0 : 0.0;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// EvaluateDef - interpret Fn's body with its parameters bound to ArgVals.
+static bool EvaluateDef(const FunctionAST &Fn, const std::vector<double> &ArgVals,
+    double &Result) {
+  const std::vector<std::string> &Params = Fn.getProto()->getArgs();
+  if (EvalDepth == 0)
+    EvalSteps = 0;
+  if (Params.size() != ArgVals.size() || EvalDepth >= MaxEvalDepth ||
+      ++EvalSteps > MaxEvalSteps)
+    return false;
+
+  std::map<std::string, double> CalleeValues;
+  for (unsigned i = 0, e = Params.size(); i != e; ++i)
+    CalleeValues[Params[i]] = ArgVals[i];
+  std::set<std::string> CalleeParams;
+
+  std::swap(EvalValues, CalleeValues);
+  std::swap(EvalParams, CalleeParams);
+  ++EvalDepth;
+  bool Ok = Fn.getBody()->evaluate(Result);
+  --EvalDepth;
+  std::swap(EvalValues, CalleeValues);
+  std::swap(EvalParams, CalleeParams);
+  return Ok;
+}
+
+bool CallExprAST::evaluate(double &Result) const {
+  // only defs can be interpreted; externs are opaque until runtime.
+  auto Def = FunctionDefs.find(Callee);
+  if (Def == FunctionDefs.end())
+    return false;
+
+  std::vector<double> ArgVals;
+  for (auto &Arg : Args) {
+    ArgVals.emplace_back();
+    if (!Arg->evaluate(ArgVals.back()))
+      return false;
+  }
+  return EvaluateDef(*Def->second, ArgVals, Result);
+}
+
+// ---------------------------- AST Optimization. --------------------------------
+
+// FastMath - allow rewrites that reassociate floating point, and mark generated
+// instructions 'fast' (-ffast-math).
+static bool FastMath = false;
+// UseEstrin - lay recognized polynomials out in Estrin's scheme rather than
+// Horner's (-poly=estrin). Fewer dependent steps, a few more multiplies.
+static bool UseEstrin = false;
+
+// Polynomial - Coeffs[d] is the coefficient of X^d, null when it is zero.
+using Polynomial = std::vector<std::unique_ptr<ExprAST>>;
+static const unsigned MaxPolyDegree = 16;
+
+static bool IsNumber(const ExprAST *E, double Val) {
+  auto *N = dynamic_cast<const NumberExprAST *>(E);
+  return N && N->getVal() == Val;
+}
+
+// MakeAdd/MakeNeg/MakeMul - build coefficient arithmetic, folding literals and
+// treating null as zero.
+static std::unique_ptr<ExprAST> MakeAdd(std::unique_ptr<ExprAST> L,
+    std::unique_ptr<ExprAST> R) {
+  if (!L || IsNumber(L.get(), 0))
+    return R;
+  if (!R || IsNumber(R.get(), 0))
+    return L;
+  auto *LN = dynamic_cast<NumberExprAST *>(L.get());
+  auto *RN = dynamic_cast<NumberExprAST *>(R.get());
+  if (LN && RN)
+    return std::make_unique<NumberExprAST>(LN->getVal() + RN->getVal());
+  return std::make_unique<BinaryExprAST>('+', std::move(L), std::move(R));
+}
+
+static std::unique_ptr<ExprAST> MakeNeg(std::unique_ptr<ExprAST> E) {
+  if (!E)
+    return nullptr;
+  if (auto *N = dynamic_cast<NumberExprAST *>(E.get()))
+    return std::make_unique<NumberExprAST>(-N->getVal());
+  return std::make_unique<BinaryExprAST>('-',
+      std::make_unique<NumberExprAST>(0), std::move(E));
+}
+
+static std::unique_ptr<ExprAST> MakeMul(std::unique_ptr<ExprAST> L,
+    std::unique_ptr<ExprAST> R) {
+  if (!L || !R || IsNumber(L.get(), 0) || IsNumber(R.get(), 0))
+    return nullptr;
+  if (IsNumber(L.get(), 1))
+    return R;
+  if (IsNumber(R.get(), 1))
+    return L;
+  auto *LN = dynamic_cast<NumberExprAST *>(L.get());
+  auto *RN = dynamic_cast<NumberExprAST *>(R.get());
+  if (LN && RN)
+    return std::make_unique<NumberExprAST>(LN->getVal() * RN->getVal());
+  return std::make_unique<BinaryExprAST>('*', std::move(L), std::move(R));
+}
+
+static void CollectVariables(const ExprAST &E, std::set<std::string> &Names) {
+  if (auto *V = dynamic_cast<const VariableExprAST *>(&E)) {
+    Names.insert(V->getName());
+  } else if (auto *B = dynamic_cast<const BinaryExprAST *>(&E)) {
+    CollectVariables(*B->getLHS(), Names);
+    CollectVariables(*B->getRHS(), Names);
+  } else if (auto *C = dynamic_cast<const CallExprAST *>(&E)) {
+    for (auto &Arg : C->getArgs())
+      CollectVariables(*Arg, Names);
+  }
+}
+
+// ContainsCall - true if evaluating E calls anything. Such a subtree must be
+// neither dropped nor repeated, as a call may have side effects.
+static bool ContainsCall(const ExprAST &E) {
+  if (auto *B = dynamic_cast<const BinaryExprAST *>(&E))
+    return ContainsCall(*B->getLHS()) || ContainsCall(*B->getRHS());
+  return dynamic_cast<const CallExprAST *>(&E) != nullptr;
+}
+
+static unsigned CountMultiplies(const ExprAST &E) {
+  if (auto *B = dynamic_cast<const BinaryExprAST *>(&E))
+    return (B->getOp() == '*') + CountMultiplies(*B->getLHS()) +
+      CountMultiplies(*B->getRHS());
+  if (auto *C = dynamic_cast<const CallExprAST *>(&E)) {
+    unsigned N = 0;
+    for (auto &Arg : C->getArgs())
+      N += CountMultiplies(*Arg);
+    return N;
+  }
+  return 0;
+}
+
+// IsPolynomialOp - the operators polynomials are built from.
+static bool IsPolynomialOp(char Op) {
+  return Op == '+' || Op == '-' || Op == '*';
+}
+
+// ToPolynomial - expand E as a polynomial in X. Subtrees that do not mention X
+// become coefficients; fails on any other operator or call that takes X, or
+// past MaxPolyDegree.
+static bool ToPolynomial(const ExprAST &E, const std::string &X, Polynomial &P) {
+  P.clear();
+  auto *V = dynamic_cast<const VariableExprAST *>(&E);
+  if (V && V->getName() == X) {
+    P.resize(2);
+    P[1] = std::make_unique<NumberExprAST>(1);
+    return true;
+  }
+
+  auto *B = dynamic_cast<const BinaryExprAST *>(&E);
+  if (!B || !IsPolynomialOp(B->getOp())) {
+    std::set<std::string> Names;
+    CollectVariables(E, Names);
+    if (Names.count(X))
+      return false;
+    P.push_back(E.clone());
+    return true;
+  }
+
+  Polynomial L, R;
+  if (!ToPolynomial(*B->getLHS(), X, L) || !ToPolynomial(*B->getRHS(), X, R))
+    return false;
+
+  if (B->getOp() == '*') {
+    if (L.size() + R.size() - 2 > MaxPolyDegree)
+      return false;
+    P.resize(L.size() + R.size() - 1);
+    for (size_t i = 0; i != L.size(); ++i)
+      for (size_t j = 0; j != R.size(); ++j)
+        if (L[i] && R[j])
+          P[i + j] = MakeAdd(std::move(P[i + j]),
+              MakeMul(L[i]->clone(), R[j]->clone()));
+    return true;
+  }
+
+  P.resize(std::max(L.size(), R.size()));
+  for (size_t d = 0; d != P.size(); ++d) {
+    std::unique_ptr<ExprAST> LC = d < L.size() ? std::move(L[d]) : nullptr;
+    std::unique_ptr<ExprAST> RC = d < R.size() ? std::move(R[d]) : nullptr;
+    P[d] = MakeAdd(std::move(LC), B->getOp() == '-' ? MakeNeg(std::move(RC)) : std::move(RC));
+  }
+  return true;
+}
+
+// BuildHorner - ((c[n]*X + c[n-1])*X + ...)*X + c[0]: n multiplies, fully serial.
+static std::unique_ptr<ExprAST> BuildHorner(Polynomial P, const std::string &X) {
+  std::unique_ptr<ExprAST> H;
+  for (size_t d = P.size(); d-- != 0;)
+    H = MakeAdd(MakeMul(std::move(H), std::make_unique<VariableExprAST>(X)),
+        std::move(P[d]));
+  return H ? std::move(H) : std::make_unique<NumberExprAST>(0);
+}
+
+// BuildEstrin - pair terms as (c[2i] + c[2i+1]*X), then combine pairs with X^2,
+// X^4, ... so the dependency chain is logarithmic in the degree. The powers are
+// spelled out as repeated subtrees; EarlyCSE shares them after codegen.
+static std::unique_ptr<ExprAST> BuildEstrin(Polynomial P, const std::string &X) {
+  std::vector<std::unique_ptr<ExprAST>> Terms;
+  for (size_t d = 0; d < P.size(); d += 2) {
+    std::unique_ptr<ExprAST> Odd = d + 1 < P.size() ? std::move(P[d + 1]) : nullptr;
+    Terms.push_back(MakeAdd(std::move(P[d]),
+        MakeMul(std::move(Odd), std::make_unique<VariableExprAST>(X))));
+  }
+
+  std::unique_ptr<ExprAST> Power = std::make_unique<VariableExprAST>(X);
+  while (Terms.size() > 1) {
+    std::unique_ptr<ExprAST> Square = Power->clone();
+    Power = MakeMul(std::move(Square), std::move(Power));
+    std::vector<std::unique_ptr<ExprAST>> Next;
+    for (size_t i = 0; i < Terms.size(); i += 2) {
+      std::unique_ptr<ExprAST> Hi = i + 1 < Terms.size() ? std::move(Terms[i + 1]) : nullptr;
+      Next.push_back(MakeAdd(std::move(Terms[i]), MakeMul(std::move(Hi), Power->clone())));
+    }
+    Terms = std::move(Next);
+  }
+  return Terms[0] ? std::move(Terms[0]) : std::make_unique<NumberExprAST>(0);
+}
+
+static std::unique_ptr<ExprAST> RewritePolynomials(const ExprAST &E);
+
+// RewriteAsPolynomial - if B is a polynomial of degree 2 or more in one of the
+// variables in Vars and Horner's form needs fewer multiplies, return it
+// rewritten in the selected scheme, choosing the variable that saves the most.
+// Expanding may fold a coefficient away or copy it, so B must make no calls.
+static std::unique_ptr<ExprAST> RewriteAsPolynomial(const BinaryExprAST &B,
+    const std::set<std::string> &Vars) {
+  if (ContainsCall(B))
+    return nullptr;
+  unsigned BestMuls = CountMultiplies(B);
+  std::string BestVar;
+  for (auto &X : Vars) {
+    Polynomial P;
+    if (!ToPolynomial(B, X, P) || P.size() < 3)
+      continue;
+    unsigned Muls = CountMultiplies(*BuildHorner(std::move(P), X));
+    if (Muls < BestMuls) {
+      BestMuls = Muls;
+      BestVar = X;
+    }
+  }
+  if (BestVar.empty())
+    return nullptr;
+
+  Polynomial P;
+  ToPolynomial(B, BestVar, P);
+  for (auto &Coeff : P)
+    if (Coeff)
+      Coeff = RewritePolynomials(*Coeff); // polynomials in the other variables.
+  return UseEstrin ? BuildEstrin(std::move(P), BestVar)
+                   : BuildHorner(std::move(P), BestVar);
+}
+
+// PolynomialVars - for each '+', '-' and '*' node, the variables it is a
+// polynomial in: those it mentions, less any under a call or another operator.
+using PolynomialVars = std::map<const ExprAST *, std::set<std::string>>;
+
+// FindPolynomialVars - fill in Vars for the nodes of the region of '+', '-' and
+// '*' nodes rooted at E. Mentioned gets the variables E mentions, and Blocked
+// those of them it is not a polynomial in.
+static void FindPolynomialVars(const ExprAST &E, PolynomialVars &Vars,
+    std::set<std::string> &Mentioned, std::set<std::string> &Blocked) {
+  auto *B = dynamic_cast<const BinaryExprAST *>(&E);
+  if (!B || !IsPolynomialOp(B->getOp())) {
+    std::set<std::string> Names;
+    CollectVariables(E, Names);
+    Mentioned.insert(Names.begin(), Names.end());
+    if (!dynamic_cast<const VariableExprAST *>(&E))
+      Blocked.insert(Names.begin(), Names.end());
+    return;
+  }
+
+  std::set<std::string> M, Bl;
+  FindPolynomialVars(*B->getLHS(), Vars, M, Bl);
+  FindPolynomialVars(*B->getRHS(), Vars, M, Bl);
+  std::set<std::string> &Free = Vars[&E];
+  std::set_difference(M.begin(), M.end(), Bl.begin(), Bl.end(),
+      std::inserter(Free, Free.end()));
+  Mentioned.insert(M.begin(), M.end());
+  Blocked.insert(Bl.begin(), Bl.end());
+}
+
+// RewritePolynomialRegion - RewritePolynomials within a region of '+', '-' and
+// '*' nodes. Each node is tried as a polynomial only in the variables none of
+// the nodes above it is one in, so that only maximal polynomial subtrees are
+// tried, once each.
+static std::unique_ptr<ExprAST> RewritePolynomialRegion(const ExprAST &E,
+    const PolynomialVars &Vars, const std::set<std::string> &Covered) {
+  auto *B = dynamic_cast<const BinaryExprAST *>(&E);
+  if (!B || !IsPolynomialOp(B->getOp()))
+    return RewritePolynomials(E);
+
+  const std::set<std::string> &Free = Vars.at(B);
+  std::set<std::string> Candidates;
+  std::set_difference(Free.begin(), Free.end(), Covered.begin(), Covered.end(),
+      std::inserter(Candidates, Candidates.end()));
+  if (!Candidates.empty())
+    if (auto Rewritten = RewriteAsPolynomial(*B, Candidates))
+      return Rewritten;
+
+  std::set<std::string> Inner = Covered;
+  Inner.insert(Free.begin(), Free.end());
+  return std::make_unique<BinaryExprAST>(B->getOp(),
+      RewritePolynomialRegion(*B->getLHS(), Vars, Inner),
+      RewritePolynomialRegion(*B->getRHS(), Vars, Inner));
+}
+
+// RewritePolynomials - copy of E with every maximal polynomial subtree
+// rewritten into Horner or Estrin form.
+static std::unique_ptr<ExprAST> RewritePolynomials(const ExprAST &E) {
+  if (auto *B = dynamic_cast<const BinaryExprAST *>(&E)) {
+    if (IsPolynomialOp(B->getOp())) {
+      PolynomialVars Vars;
+      std::set<std::string> Mentioned, Blocked;
+      FindPolynomialVars(E, Vars, Mentioned, Blocked);
+      return RewritePolynomialRegion(E, Vars, {});
+    }
+    return std::make_unique<BinaryExprAST>(B->getOp(),
+        RewritePolynomials(*B->getLHS()), RewritePolynomials(*B->getRHS()));
+  }
+  if (auto *C = dynamic_cast<const CallExprAST *>(&E)) {
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    for (auto &Arg : C->getArgs())
+      Args.push_back(RewritePolynomials(*Arg));
+    return std::make_unique<CallExprAST>(C->getCallee(), std::move(Args));
+  }
+  return E.clone();
+}
+
+// UseEGraph - run the equality-saturation optimizer on every body (-egraph).
+static bool UseEGraph = false;
+static std::unique_ptr<ExprAST> OptimizeWithEGraph(const ExprAST &E);
+
+// RunASTPasses - tree-level rewrites applied to each def and top-level
+// expression before codegen.
+static void RunASTPasses(FunctionAST &Fn) {
+  if (FastMath)
+    Fn.setBody(RewritePolynomials(*Fn.getBody()));
+  if (UseEGraph)
+    Fn.setBody(OptimizeWithEGraph(*Fn.getBody()));
+}
+
 // ---------------------------- Code Generation. ---------------------------------
-static std::unique_ptr<LLVMContext> Context; // contains alot of core LLVM data structures.
+static LLVMContext *Context; // contains alot of core LLVM data structures.
+static orc::ThreadSafeContext TheContext; // owns Context; from TheContextPool.
 static std::unique_ptr<IRBuilder<>> Builder; // makes it easy to generate LLVM instructions.
 static std::unique_ptr<Module> TheModule;    // contains functions and global variables.
-static std::map<std::stirng, Value *> NamedValues; // keeps track of which values are defined in the current scope and what their llvm representation is.
+static std::unique_ptr<legacy::FunctionPassManager> TheFPM; // cleanups run on each function, -ffast-math only.
+static std::unique_ptr<TargetMachine> TheTargetMachine; // the host: its CPU and features, not a generic baseline.
+static std::string HostCPU, HostFeatures;
+static std::map<std::string, Value *> NamedValues; // keeps track of which values are defined in the current scope and what their llvm representation is.
 
 Value *LogErrorV(const char *Str) {
   LogError(Str);
@@ -389,14 +1500,20 @@ Value *LogErrorV(const char *Str) {
 }
 
 Value *NumberExprAST::codegen() {
-  return ConstandFP::get(*Context, APFloat(Val));
+  return ConstantFP::get(*Context, APFloat(Val));
 }
 
 Value *VariableExprAST::codegen() {
   Value *V = NamedValues[Name];
-  if (!V)
-    LogErrorV("Unknown variable name");
-  return V;
+  if (V)
+    return V;
+
+  // constants are inlined at every reference.
+  auto Const = ConstantValues.find(Name);
+  if (Const != ConstantValues.end())
+    return ConstantFP::get(*Context, APFloat(Const->second));
+
+  return LogErrorV("Unknown variable name");
 }
 
 Value *BinaryExprAST::codegen() {
@@ -422,9 +1539,11 @@ Value *BinaryExprAST::codegen() {
   }
 }
 
+static Function *GetFunctionDecl(const std::string &Name);
+
 Value *CallExprAST::codegen() {
   //look up the name in the global module table.
-  Function *CalleeF = TheModule->getFunction(Callee);
+  Function *CalleeF = GetFunctionDecl(ResolveMergedDef(Callee));
 
   if (!CalleeF)
     return LogErrorV("Unknown function referenced.");
@@ -433,29 +1552,4231 @@ Value *CallExprAST::codegen() {
     return LogErrorV("Incorrect number of arguments passed.");
 
   std::vector<Value *> ArgsV;
-  for (unsigned i = 0; e = Args.size(); i != e; ++i) {
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
     ArgsV.push_back(Args[i]->codegen());
     if (!ArgsV.back())
       return nullptr;
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
-}
 
+  // libm functions an LLVM intrinsic means exactly; it lowers to an
+  // instruction or two and needs no libm to link against.
+  if (!FunctionDefs.count(Callee)) {
+    if (Callee == "fabs" && ArgsV.size() == 1)
+      return Builder->CreateUnaryIntrinsic(Intrinsic::fabs, ArgsV[0], nullptr, "calltmp");
+    if (Callee == "fmin" && ArgsV.size() == 2)
+      return Builder->CreateBinaryIntrinsic(Intrinsic::minnum, ArgsV[0], ArgsV[1], nullptr, "calltmp");
+    if (Callee == "fmax" && ArgsV.size() == 2)
+      return Builder->CreateBinaryIntrinsic(Intrinsic::maxnum, ArgsV[0], ArgsV[1], nullptr, "calltmp");
+  }
 
+  CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  Call->setCallingConv(CalleeF->getCallingConv());
+  return Call;
+}
 
-// -------------------------------------------------------------------------------
+// CreateFunctionDecl - declare (or find) double Name(double...) in the module.
+static Function *CreateFunctionDecl(const std::string &Name,
+    const std::vector<std::string> &Args) {
+  if (Function *F = TheModule->getFunction(Name))
+    return F;
 
+  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*Context));
+  FunctionType *FT =
+    FunctionType::get(Type::getDoubleTy(*Context), Doubles, false);
+  Function *F =
+    Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
 
-int main() {
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
+  // set names for all arguments.
+  unsigned Idx = 0;
+  for (auto &Arg : F->args())
+    Arg.setName(Args[Idx++]);
+  return F;
+}
+
+// GetFunctionDecl - the function Name in the current module. With -jit each item
+// gets a fresh module, and with -project each file, so defs and externs from
+// elsewhere are redeclared.
+static Function *GetFunctionDecl(const std::string &Name) {
+  if (Function *F = TheModule->getFunction(Name))
+    return F;
+  if (!UseJIT && !ProjectBuild)
+    return nullptr;
+  auto Def = FunctionDefs.find(Name);
+  if (Def != FunctionDefs.end())
+    return CreateFunctionDecl(Name, Def->second->getProto()->getArgs());
+  auto Extern = ExternProtos.find(Name);
+  if (Extern != ExternProtos.end())
+    return CreateFunctionDecl(Name, Extern->second->getArgs());
+  return nullptr;
+}
+
+// ApplyExportModel - a def that is not exported is internal and called with fastcc,
+// so LLVM is free to inline, specialize or drop it. Exported defs, anonymous
+// top-level expressions and functions already called through an extern
+// declaration keep external linkage and the C calling convention, as does
+// everything under -jit, where later modules call defs by name.
+static void ApplyExportModel(Function *F, bool Exported) {
+  if (Exported || UseJIT || F->getName().empty() || !F->use_empty())
+    return;
+  F->setLinkage(Function::InternalLinkage);
+  F->setCallingConv(CallingConv::Fast);
+}
+
+// BeginFunctionBody - open the entry block of F and bind its arguments in NamedValues.
+static bool BeginFunctionBody(Function *F) {
+  if (!F->empty()) {
+    LogError("Function cannot be redefined.");
+    return false;
+  }
+
+  BasicBlock *BB = BasicBlock::Create(*Context, "entry", F);
+  Builder->SetInsertPoint(BB);
+
+  NamedValues.clear();
+  for (auto &Arg : F->args())
+    NamedValues[std::string(Arg.getName())] = &Arg;
+  return true;
+}
+
+// FinishFunctionBody - return RetVal from F, or drop F if the body failed to generate.
+// F stays as a declaration while anything calls it, e.g. the rest of its SCC
+// under -batch.
+static Function *FinishFunctionBody(Function *F, Value *RetVal) {
+  if (!RetVal) {
+    F->deleteBody();
+    if (F->use_empty())
+      F->eraseFromParent();
+    return nullptr;
+  }
+  Builder->CreateRet(RetVal);
+  if (TheTargetMachine) {
+    F->addFnAttr("target-cpu", HostCPU);
+    F->addFnAttr("target-features", HostFeatures);
+  }
+  verifyFunction(*F);
+  if (TheFPM)
+    TheFPM->run(*F);
+  return F;
+}
+
+Function *PrototypeAST::codegen() {
+  return CreateFunctionDecl(Name, Args);
+}
+
+// EmitTableLookup - for a 'table(lo, hi)' def, evaluate Fn at every integer in
+// the range now and emit the entry of F as a bounds-checked load from that
+// constant array. Arguments that are out of range or not integral fall through
+// to a block where the Builder is left to compute the body as usual.
+static bool EmitTableLookup(Function *F, const FunctionAST &Fn) {
+  const PrototypeAST &Proto = *Fn.getProto();
+  int Lo = Proto.getTableLo(), Hi = Proto.getTableHi();
+
+  std::vector<double> Vals;
+  for (int64_t i = Lo; i <= Hi; ++i) {
+    Vals.emplace_back();
+    if (!EvaluateDef(Fn, {(double)i}, Vals.back())) {
+      LogError("'table' def must be evaluable at compile time over its range.");
+      return false;
+    }
+  }
+
+  auto *Table = new GlobalVariable(*TheModule,
+      ArrayType::get(Type::getDoubleTy(*Context), Vals.size()), true,
+      GlobalValue::PrivateLinkage, ConstantDataArray::get(*Context, Vals),
+      Proto.getName() + ".table");
+
+  BasicBlock *CheckBB = BasicBlock::Create(*Context, "tablecheck", F);
+  BasicBlock *LookupBB = BasicBlock::Create(*Context, "tablelookup", F);
+  BasicBlock *ComputeBB = BasicBlock::Create(*Context, "compute", F);
+
+  // ordered compares, so NaN goes to the computed path.
+  Value *X = F->getArg(0);
+  Value *AboveLo =
+    Builder->CreateFCmpOGE(X, ConstantFP::get(*Context, APFloat((double)Lo)), "abovelo");
+  Value *BelowHi =
+    Builder->CreateFCmpOLE(X, ConstantFP::get(*Context, APFloat((double)Hi)), "belowhi");
+  Value *InRange = Builder->CreateAnd(AboveLo, BelowHi, "inrange");
+  Builder->CreateCondBr(InRange, CheckBB, ComputeBB);
+
+  Builder->SetInsertPoint(CheckBB);
+  Type *I64 = Type::getInt64Ty(*Context);
+  Value *Idx = Builder->CreateFPToSI(X, I64, "idx");
+  Value *IsInt = Builder->CreateFCmpOEQ(
+      Builder->CreateSIToFP(Idx, Type::getDoubleTy(*Context)), X, "isint");
+  Builder->CreateCondBr(IsInt, LookupBB, ComputeBB);
+
+  Builder->SetInsertPoint(LookupBB);
+  Value *Slot = Builder->CreateInBoundsGEP(Table->getValueType(), Table,
+      {ConstantInt::get(I64, 0), Builder->CreateSub(Idx, ConstantInt::get(I64, Lo))});
+  Builder->CreateRet(Builder->CreateLoad(Type::getDoubleTy(*Context), Slot, "tableval"));
+
+  Builder->SetInsertPoint(ComputeBB);
+  return true;
+}
+
+Function *FunctionAST::codegen() {
+  Function *TheFunction = Proto->codegen();
+  if (!BeginFunctionBody(TheFunction))
+    return nullptr;
+  ApplyExportModel(TheFunction, Proto->isExported());
+  if (Proto->hasTable() && !EmitTableLookup(TheFunction, *this))
+    return FinishFunctionBody(TheFunction, nullptr);
+  return FinishFunctionBody(TheFunction, Body->codegen());
+}
+
+// Multiversion - give exported defs AVX-512, AVX2 and baseline clones behind a
+// runtime dispatcher when emitting an object file (-multiversion).
+static bool Multiversion = false;
+
+// InitializeHostTarget - set up TheTargetMachine for the CPU we are running on,
+// or for baseline x86-64 under -multiversion, where only the clones may go
+// beyond it and only by the feature their dispatch checks.
+static bool InitializeHostTarget() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  std::string TargetTriple = sys::getProcessTriple();
+  std::string Error;
+  const Target *T = TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (!T) {
+    fprintf(stderr, "Error: %s\n", Error.c_str());
+    return false;
+  }
+
+  HostCPU = sys::getHostCPUName().str();
+  SubtargetFeatures Features;
+  StringMap<bool> HostFeatureMap;
+  if (sys::getHostCPUFeatures(HostFeatureMap))
+    for (auto &Feature : HostFeatureMap)
+      Features.AddFeature(Feature.first(), Feature.second);
+  HostFeatures = Features.getString();
+  if (Multiversion && Triple(TargetTriple).getArch() == Triple::x86_64) {
+    HostCPU = "x86-64";
+    HostFeatures.clear();
+  }
+
+  TheTargetMachine.reset(T->createTargetMachine(TargetTriple, HostCPU,
+        HostFeatures, TargetOptions(), Reloc::PIC_));
+  return TheTargetMachine != nullptr;
+}
+
+// CreateHostTargetMachine - another one like TheTargetMachine, for a backend
+// running on a thread of its own; one TargetMachine cannot run two at once.
+static std::unique_ptr<TargetMachine> CreateHostTargetMachine() {
+  return std::unique_ptr<TargetMachine>(TheTargetMachine->getTarget().createTargetMachine(
+        TheTargetMachine->getTargetTriple().str(), HostCPU, HostFeatures,
+        TargetOptions(), Reloc::PIC_));
+}
+
+// ContextReuse - modules built in one LLVMContext before it is retired
+// (-context-reuse=N). A context keeps every constant and type its modules
+// uniqued, so using one forever grows without bound, while making a fresh one
+// for each module costs more than compiling a small def.
+static unsigned ContextReuse = 256;
+
+// ContextPool - hands out LLVMContexts to compile jobs: each module for -jit,
+// and the scratch modules of the autotuner and the profiler. A released
+// context goes back on the free list until it has served ContextReuse jobs;
+// then the pool drops it, and it goes away with the last module still in it.
+class ContextPool {
+  std::mutex Lock;
+  std::vector<orc::ThreadSafeContext> Free;
+  std::map<LLVMContext *, unsigned> Jobs; // jobs served by each pooled context.
+
+  public:
+    orc::ThreadSafeContext acquire() {
+      std::lock_guard<std::mutex> L(Lock);
+      if (Free.empty())
+        Free.push_back(orc::ThreadSafeContext(std::make_unique<LLVMContext>()));
+      orc::ThreadSafeContext TSC = std::move(Free.back());
+      Free.pop_back();
+      ++Jobs[TSC.getContext()];
+      return TSC;
+    }
+
+    void release(orc::ThreadSafeContext TSC) {
+      std::lock_guard<std::mutex> L(Lock);
+      auto J = Jobs.find(TSC.getContext());
+      if (J->second < ContextReuse)
+        Free.push_back(std::move(TSC));
+      else
+        Jobs.erase(J);
+    }
+};
+
+static ContextPool TheContextPool;
+
+static void InitializeModule() {
+  TheContext = TheContextPool.acquire();
+  Context = TheContext.getContext();
+  TheModule = std::make_unique<Module>("my cool jit", *Context);
+  // the builder only depends on the context, so it outlives recycled modules.
+  if (Builder && &Builder->getContext() == Context)
+    Builder->ClearInsertionPoint();
+  else
+    Builder = std::make_unique<IRBuilder<>>(*Context);
+
+  if (TheTargetMachine) {
+    TheModule->setDataLayout(TheTargetMachine->createDataLayout());
+    TheModule->setTargetTriple(TheTargetMachine->getTargetTriple().str());
+  }
+
+  if (FastMath) {
+    Builder->setFastMathFlags(FastMathFlags::getFast());
+    // share the repeated subterms that AST rewrites (e.g. Estrin's powers) spell out.
+    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+    TheFPM->add(createEarlyCSEPass());
+    TheFPM->doInitialization();
+  }
+}
+
+// ---------------------------- Symbolic Differentiation. -----------------------
+// 'grad f' defines, for each parameter p of f, a def named d<f>d<p> with f's
+// parameters that returns the partial derivative of f with respect to p. The
+// derivatives are built symbolically on the AST and compiled like any def, one
+// def per parameter, so at run time the partials share no work beyond what
+// LLVM finds inside each one. Null expressions stand for zero, as in the
+// polynomial helpers.
+
+// GradientName - name of the def holding d(Fn)/d(Param).
+static std::string GradientName(const std::string &Fn, const std::string &Param) {
+  return "d" + Fn + "d" + Param;
+}
+
+// DeclaredExtern - true if Name is an extern taking NumArgs arguments.
+static bool DeclaredExtern(const std::string &Name, unsigned NumArgs) {
+  Function *F = GetFunctionDecl(Name);
+  return F && F->arg_size() == NumArgs && !FunctionDefs.count(Name);
+}
+
+static std::unique_ptr<ExprAST> MakeCall(const std::string &Callee,
+    std::unique_ptr<ExprAST> Arg) {
+  std::vector<std::unique_ptr<ExprAST>> Args;
+  Args.push_back(std::move(Arg));
+  return std::make_unique<CallExprAST>(Callee, std::move(Args));
+}
+
+static std::unique_ptr<ExprAST> MakePow(std::unique_ptr<ExprAST> Base, double Exp) {
+  std::vector<std::unique_ptr<ExprAST>> Args;
+  Args.push_back(std::move(Base));
+  Args.push_back(std::make_unique<NumberExprAST>(Exp));
+  return std::make_unique<CallExprAST>("pow", std::move(Args));
+}
+
+// CallPartial - the partial derivative of call C with respect to its I'th
+// argument, evaluated at C's arguments. Knows the libm functions sin, cos, exp,
+// log, sqrt, fabs, fmin, fmax and pow with a constant exponent (Kaleidoscope
+// has no division, so log and sqrt need pow declared), and the defs, whose
+// gradients it generates.
+static bool CallPartial(const CallExprAST &C, unsigned I,
+    std::unique_ptr<ExprAST> &Partial) {
+  const std::string &Callee = C.getCallee();
+  auto &Args = C.getArgs();
+
+  if (FunctionDefs.count(Callee)) {
+    const std::vector<std::string> &Params = FunctionDefs[Callee]->getProto()->getArgs();
+    if (Params.size() != Args.size()) {
+      fprintf(stderr, "Error: '%s' takes %zu arguments, not %zu\n", Callee.c_str(),
+          Params.size(), Args.size());
+      return false;
+    }
+    if (!GenerateGradient(Callee))
+      return false;
+    const std::string &Param = Params[I];
+    std::vector<std::unique_ptr<ExprAST>> ArgsCopy;
+    for (auto &Arg : Args)
+      ArgsCopy.push_back(Arg->clone());
+    Partial = std::make_unique<CallExprAST>(GradientName(Callee, Param),
+        std::move(ArgsCopy));
+    return true;
+  }
+
+  bool HavePow = DeclaredExtern("pow", 2);
+  double Exp;
+  if (Args.size() == 1 && Callee == "sin" && DeclaredExtern("cos", 1))
+    Partial = MakeCall("cos", Args[0]->clone());
+  else if (Args.size() == 1 && Callee == "cos" && DeclaredExtern("sin", 1))
+    Partial = MakeNeg(MakeCall("sin", Args[0]->clone()));
+  else if (Args.size() == 1 && Callee == "exp")
+    Partial = MakeCall("exp", Args[0]->clone());
+  else if (Args.size() == 1 && Callee == "log" && HavePow)
+    Partial = MakePow(Args[0]->clone(), -1);
+  else if (Args.size() == 1 && Callee == "sqrt" && HavePow)
+    Partial = MakeMul(std::make_unique<NumberExprAST>(0.5), MakePow(Args[0]->clone(), -0.5));
+  else if (Args.size() == 1 && Callee == "fabs")
+    Partial = std::make_unique<BinaryExprAST>('-',
+        std::make_unique<BinaryExprAST>('<', std::make_unique<NumberExprAST>(0), Args[0]->clone()),
+        std::make_unique<BinaryExprAST>('<', Args[0]->clone(), std::make_unique<NumberExprAST>(0)));
+  else if (Args.size() == 2 && (Callee == "fmin" || Callee == "fmax")) {
+    // the selected argument gets all of it: a<b picks a for fmin, b for fmax.
+    auto Less = std::make_unique<BinaryExprAST>('<', Args[0]->clone(), Args[1]->clone());
+    Partial = (I == 0) == (Callee == "fmin") ? std::move(Less) :
+      MakeAdd(std::make_unique<NumberExprAST>(1), MakeNeg(std::move(Less)));
+  }
+  else if (Args.size() == 2 && Callee == "pow" && Args[1]->evaluate(Exp))
+    Partial = I == 1 ? nullptr : MakeMul(std::make_unique<NumberExprAST>(Exp),
+        MakePow(Args[0]->clone(), Exp - 1));
+  else {
+    fprintf(stderr, "Error: no derivative known for '%s'\n", Callee.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Differentiate - forward mode: the derivative of E with respect to X.
+static bool Differentiate(const ExprAST &E, const std::string &X,
+    std::unique_ptr<ExprAST> &D) {
+  D = nullptr;
+  if (auto *V = dynamic_cast<const VariableExprAST *>(&E)) {
+    if (V->getName() == X)
+      D = std::make_unique<NumberExprAST>(1);
+    return true;
+  }
+  if (auto *B = dynamic_cast<const BinaryExprAST *>(&E)) {
+    if (B->getOp() == '<')
+      return true; // piecewise constant.
+    std::unique_ptr<ExprAST> DL, DR;
+    if (!Differentiate(*B->getLHS(), X, DL) || !Differentiate(*B->getRHS(), X, DR))
+      return false;
+    if (B->getOp() == '+')
+      D = MakeAdd(std::move(DL), std::move(DR));
+    else if (B->getOp() == '-')
+      D = MakeAdd(std::move(DL), MakeNeg(std::move(DR)));
+    else // product rule.
+      D = MakeAdd(MakeMul(std::move(DL), B->getRHS()->clone()),
+          MakeMul(B->getLHS()->clone(), std::move(DR)));
+    return true;
+  }
+  if (auto *C = dynamic_cast<const CallExprAST *>(&E)) {
+    // chain rule over every argument.
+    for (unsigned I = 0, N = C->getArgs().size(); I != N; ++I) {
+      std::unique_ptr<ExprAST> DArg, Partial;
+      if (!Differentiate(*C->getArgs()[I], X, DArg))
+        return false;
+      if (!DArg)
+        continue;
+      if (!CallPartial(*C, I, Partial))
+        return false;
+      D = MakeAdd(std::move(D), MakeMul(std::move(Partial), std::move(DArg)));
+    }
+  }
+  return true;
+}
+
+// AccumulateAdjoints - push Adjoint (dOutput/dE) down through E and add what
+// reaches each parameter into Grads: one walk of the body builds the
+// expression of every partial, where Differentiate needs one per parameter.
+// This is reverse accumulation at compile time only; each partial still
+// becomes an independent def.
+static bool AccumulateAdjoints(const ExprAST &E, std::unique_ptr<ExprAST> Adjoint,
+    std::map<std::string, std::unique_ptr<ExprAST>> &Grads) {
+  if (!Adjoint)
+    return true;
+  if (auto *V = dynamic_cast<const VariableExprAST *>(&E)) {
+    auto Grad = Grads.find(V->getName());
+    if (Grad != Grads.end())
+      Grad->second = MakeAdd(std::move(Grad->second), std::move(Adjoint));
+    return true;
+  }
+  if (auto *B = dynamic_cast<const BinaryExprAST *>(&E)) {
+    const ExprAST &L = *B->getLHS(), &R = *B->getRHS();
+    switch (B->getOp()) {
+      case '+':
+        return AccumulateAdjoints(L, Adjoint->clone(), Grads) &&
+          AccumulateAdjoints(R, std::move(Adjoint), Grads);
+      case '-':
+        return AccumulateAdjoints(L, Adjoint->clone(), Grads) &&
+          AccumulateAdjoints(R, MakeNeg(std::move(Adjoint)), Grads);
+      case '*':
+        return AccumulateAdjoints(L, MakeMul(Adjoint->clone(), R.clone()), Grads) &&
+          AccumulateAdjoints(R, MakeMul(std::move(Adjoint), L.clone()), Grads);
+      default:
+        return true; // '<' is piecewise constant.
+    }
+  }
+  if (auto *C = dynamic_cast<const CallExprAST *>(&E)) {
+    for (unsigned I = 0, N = C->getArgs().size(); I != N; ++I) {
+      // an argument with a zero derivative for every parameter sends nothing
+      // back, so its partial is not needed (and may not be known).
+      bool Constant = true;
+      for (auto &Grad : Grads) {
+        std::unique_ptr<ExprAST> DArg;
+        if (!Differentiate(*C->getArgs()[I], Grad.first, DArg))
+          return false;
+        if (DArg) {
+          Constant = false;
+          break;
+        }
+      }
+      if (Constant)
+        continue;
+      std::unique_ptr<ExprAST> Partial;
+      if (!CallPartial(*C, I, Partial) ||
+          !AccumulateAdjoints(*C->getArgs()[I],
+            MakeMul(Adjoint->clone(), std::move(Partial)), Grads))
+        return false;
+    }
+  }
+  return true;
+}
+
+// GradientsInProgress - defs whose gradients are being built, so that recursive
+// defs refer to their own gradient defs instead of regenerating them.
+static std::set<std::string> GradientsInProgress;
+
+// GradientDefs - each def 'grad' generated: the def it differentiates, and the
+// generated def itself, so a user def of the same name is not mistaken for it.
+static std::map<std::string, std::pair<std::string, std::shared_ptr<FunctionAST>>>
+    GradientDefs;
+
+// IsGradientOf - true if the def GradName is the one 'grad Fn' generated.
+static bool IsGradientOf(const std::string &GradName, const std::string &Fn) {
+  auto Gen = GradientDefs.find(GradName);
+  auto Def = FunctionDefs.find(GradName);
+  return Gen != GradientDefs.end() && Def != FunctionDefs.end() &&
+    Gen->second.first == Fn && Gen->second.second == Def->second;
+}
+
+// GenerateGradient - define d<Name>d<p> for every parameter p of the def Name,
+// unless that was already done. Builds every partial in one AccumulateAdjoints
+// walk when there is more than one parameter, and with Differentiate otherwise.
+// Fails rather than replace a def of the same name that it did not generate.
+static bool GenerateGradient(const std::string &Name) {
+  auto Def = FunctionDefs.find(Name);
+  if (Def == FunctionDefs.end()) {
+    fprintf(stderr, "Error: 'grad' of unknown def '%s'\n", Name.c_str());
+    return false;
+  }
+  std::shared_ptr<FunctionAST> Fn = Def->second;
+  const PrototypeAST &Proto = *Fn->getProto();
+  const std::vector<std::string> &Params = Proto.getArgs();
+
+  if (GradientsInProgress.count(Name))
+    return true;
+  bool Done = true;
+  for (auto &Param : Params) {
+    std::string GradName = GradientName(Name, Param);
+    if (FunctionDefs.count(GradName) && !IsGradientOf(GradName, Name)) {
+      fprintf(stderr, "Error: 'grad %s' would redefine '%s'\n", Name.c_str(),
+          GradName.c_str());
+      return false;
+    }
+    Done &= IsGradientOf(GradName, Name);
+  }
+  if (Done)
+    return true;
+
+  GradientsInProgress.insert(Name);
+  std::map<std::string, std::unique_ptr<ExprAST>> Grads;
+  for (auto &Param : Params)
+    Grads[Param] = nullptr;
+  // the parameters shadow consts when the rules fold an argument, e.g. pow's exponent.
+  std::set<std::string> FnParams(Params.begin(), Params.end());
+  std::map<std::string, double> FnValues;
+  std::swap(EvalParams, FnParams);
+  std::swap(EvalValues, FnValues);
+  bool Ok;
+  if (Params.size() > 1) {
+    Ok = AccumulateAdjoints(*Fn->getBody(), std::make_unique<NumberExprAST>(1), Grads);
+  } else {
+    Ok = Params.empty() ||
+      Differentiate(*Fn->getBody(), Params[0], Grads[Params[0]]);
+  }
+  std::swap(EvalParams, FnParams);
+  std::swap(EvalValues, FnValues);
+  GradientsInProgress.erase(Name);
+  if (!Ok)
+    return false;
+
+  for (auto &Param : Params) {
+    auto GradProto = std::make_unique<PrototypeAST>(GradientName(Name, Param), Params);
+    if (Proto.isExported())
+      GradProto->setExported();
+    std::unique_ptr<ExprAST> Body = std::move(Grads[Param]);
+    if (!Body)
+      Body = std::make_unique<NumberExprAST>(0);
+    fprintf(stderr, "Generated %s.\n", GradProto->getName().c_str());
+    std::string GradName = GradProto->getName();
+    auto GradAST = std::make_shared<FunctionAST>(std::move(GradProto), std::move(Body));
+    GradientDefs[GradName] = {Name, GradAST};
+    CompileDefinition(GradAST);
+  }
+  return true;
+}
+
+// ---------------------------- E-Graph Optimization. ----------------------------
+// Equality saturation: the body is loaded into an e-graph, rewrite rules add
+// equivalent forms until nothing new appears or the budget runs out, and the
+// form with the lowest latency is extracted. Rules that are exact in IEEE
+// arithmetic always run; reassociating ones need -ffast-math.
+
+static unsigned EGraphIterations = 8; // -egraph-iters=N
+static unsigned EGraphTimeMs = 50;    // -egraph-ms=N
+static const size_t EGraphMaxNodes = 20000;
+
+namespace {
+// ENode - one operator applied to e-classes.
+struct ENode {
+  char Op;       // '+', '-', '*', '<', 'n'umber, 'v'ariable or 'c'all.
+  uint64_t Bits; // 'n': bit pattern of the value, so NaNs still order.
+  std::string Name; // 'v': variable, 'c': callee.
+  std::vector<unsigned> Children;
+
+  double getVal() const {
+    double Val;
+    memcpy(&Val, &Bits, sizeof(Val));
+    return Val;
+  }
+  bool operator<(const ENode &O) const {
+    return std::tie(Op, Bits, Name, Children) <
+      std::tie(O.Op, O.Bits, O.Name, O.Children);
+  }
+  bool operator==(const ENode &O) const {
+    return Op == O.Op && Bits == O.Bits && Name == O.Name && Children == O.Children;
+  }
+};
+
+ENode MakeENode(char Op, std::vector<unsigned> Children) {
+  return ENode{Op, 0, "", std::move(Children)};
+}
+
+ENode MakeNumberENode(double Val) {
+  ENode N{'n', 0, "", {}};
+  memcpy(&N.Bits, &Val, sizeof(Val));
+  return N;
+}
+
+class EGraph {
+  std::vector<unsigned> Leader;          // union-find over e-class ids.
+  std::vector<std::vector<ENode>> Nodes; // nodes of each class, kept at its leader.
+  std::map<ENode, unsigned> Memo;        // hashcons of canonical nodes.
+
+  ENode canonical(ENode N) {
+    for (auto &C : N.Children)
+      C = find(C);
+    return N;
+  }
+
+  public:
+    unsigned find(unsigned C) {
+      while (Leader[C] != C)
+        C = Leader[C] = Leader[Leader[C]];
+      return C;
+    }
+
+    unsigned add(ENode N) {
+      N = canonical(std::move(N));
+      auto I = Memo.find(N);
+      if (I != Memo.end())
+        return find(I->second);
+      unsigned Id = Leader.size();
+      Leader.push_back(Id);
+      Nodes.push_back({N});
+      Memo[N] = Id;
+      return Id;
+    }
+
+    bool merge(unsigned A, unsigned B) {
+      A = find(A);
+      B = find(B);
+      if (A == B)
+        return false;
+      if (Nodes[A].size() < Nodes[B].size())
+        std::swap(A, B);
+      Leader[B] = A;
+      Nodes[A].insert(Nodes[A].end(), Nodes[B].begin(), Nodes[B].end());
+      Nodes[B].clear();
+      return true;
+    }
+
+    // rebuild - after merges, re-canonicalize every node and merge classes
+    // that now hold the same node (congruence closure).
+    void rebuild() {
+      std::vector<std::pair<unsigned, unsigned>> Pending;
+      do {
+        for (auto &P : Pending)
+          merge(P.first, P.second);
+        Pending.clear();
+        Memo.clear();
+        for (unsigned C = 0; C != Leader.size(); ++C) {
+          if (find(C) != C)
+            continue;
+          for (auto &N : Nodes[C])
+            N = canonical(N);
+          std::sort(Nodes[C].begin(), Nodes[C].end());
+          Nodes[C].erase(std::unique(Nodes[C].begin(), Nodes[C].end()), Nodes[C].end());
+          for (auto &N : Nodes[C]) {
+            auto I = Memo.emplace(N, C);
+            if (!I.second && find(I.first->second) != C)
+              Pending.push_back({I.first->second, C});
+          }
+        }
+      } while (!Pending.empty());
+    }
+
+    unsigned numClasses() const { return Leader.size(); }
+    size_t numNodes() const { return Memo.size(); }
+    const std::vector<ENode> &nodes(unsigned C) const { return Nodes[C]; }
+
+    // getNumber - true if class C is known to be the literal Val.
+    bool getNumber(unsigned C, double &Val) {
+      for (auto &N : Nodes[find(C)])
+        if (N.Op == 'n') {
+          Val = N.getVal();
+          return true;
+        }
+      return false;
+    }
+    bool isNumber(unsigned C, double Val) {
+      double V;
+      return getNumber(C, V) && V == Val;
+    }
+};
+}
+
+static unsigned AddToEGraph(EGraph &G, const ExprAST &E) {
+  if (auto *N = dynamic_cast<const NumberExprAST *>(&E))
+    return G.add(MakeNumberENode(N->getVal()));
+  if (auto *V = dynamic_cast<const VariableExprAST *>(&E))
+    return G.add(ENode{'v', 0, V->getName(), {}});
+  if (auto *B = dynamic_cast<const BinaryExprAST *>(&E))
+    return G.add(MakeENode(B->getOp(),
+          {AddToEGraph(G, *B->getLHS()), AddToEGraph(G, *B->getRHS())}));
+  auto &C = static_cast<const CallExprAST &>(E);
+  ENode N{'c', 0, C.getCallee(), {}};
+  for (auto &Arg : C.getArgs())
+    N.Children.push_back(AddToEGraph(G, *Arg));
+  return G.add(N);
+}
+
+// FindCallingClasses - which classes may make a call, i.e. have a call node in
+// them or below them, indexed by every id there is so far. Rules that drop an
+// operand must not drop those: the callee may be an extern with side effects,
+// like putchard.
+static std::vector<bool> FindCallingClasses(EGraph &G) {
+  std::vector<bool> Calls(G.numClasses(), false);
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned C = 0; C != G.numClasses(); ++C) {
+      if (G.find(C) != C || Calls[C])
+        continue;
+      for (const ENode &N : G.nodes(C)) {
+        bool NodeCalls = N.Op == 'c';
+        for (unsigned Child : N.Children)
+          NodeCalls |= Calls[G.find(Child)];
+        if (NodeCalls) {
+          Calls[C] = Changed = true;
+          break;
+        }
+      }
+    }
+  }
+  for (unsigned C = 0; C != G.numClasses(); ++C)
+    Calls[C] = Calls[G.find(C)];
+  return Calls;
+}
+
+// ApplyRewrites - one round of every rule over every class, or as much of it
+// as fits in the budget: a single node can add thousands. The pow and sqrt
+// rules need LibmPow and HaveSqrt, that those names are libm's and not defs.
+// Returns true if the graph changed.
+static bool ApplyRewrites(EGraph &G, bool LibmPow, bool HaveSqrt,
+    std::chrono::steady_clock::time_point Deadline) {
+  bool Changed = false, Stop = false;
+  auto OverBudget = [&] {
+    return Stop = Stop || G.numNodes() > EGraphMaxNodes ||
+      std::chrono::steady_clock::now() > Deadline;
+  };
+  auto Equate = [&](unsigned C, ENode N) { Changed |= G.merge(C, G.add(std::move(N))); };
+  auto Same = [&](unsigned C, unsigned Other) { Changed |= G.merge(C, Other); };
+  std::vector<bool> Calls = FindCallingClasses(G);
+  auto MayCall = [&](unsigned C) { return C >= Calls.size() || Calls[C]; };
+
+  for (unsigned C = 0, NumClasses = G.numClasses(); C != NumClasses && !Stop; ++C) {
+    if (G.find(C) != C)
+      continue;
+    std::vector<ENode> Snapshot = G.nodes(C);
+    for (const ENode &N : Snapshot) {
+      if (OverBudget())
+        break;
+      if (N.Op == 'n' || N.Op == 'v')
+        continue;
+
+      if (N.Op == 'c') {
+        // pow(x, k) for small k and sqrt(x)*sqrt(x) under fast-math.
+        double K;
+        if (!FastMath || !LibmPow || N.Name != "pow" || N.Children.size() != 2 ||
+            !G.getNumber(N.Children[1], K))
+          continue;
+        unsigned X = N.Children[0];
+        if (K == 1)
+          Same(C, X);
+        else if (MayCall(X))
+          continue; // the products below would repeat its calls.
+        else if (K == 2)
+          Equate(C, MakeENode('*', {X, X}));
+        else if (K == 3)
+          Equate(C, MakeENode('*', {G.add(MakeENode('*', {X, X})), X}));
+        else if (K == 0.5 && HaveSqrt)
+          Equate(C, ENode{'c', 0, "sqrt", {X}});
+        continue;
+      }
+
+      unsigned A = N.Children[0], B = N.Children[1];
+      double L, R;
+      if (G.getNumber(A, L) && G.getNumber(B, R)) {
+        // constant folding, with the same semantics as the constant evaluator.
+        double Val = N.Op == '+' ? L + R : N.Op == '-' ? L - R :
+          N.Op == '*' ? L * R : (!(L >= R) ? 1.0 : 0.0);
+        Equate(C, MakeNumberENode(Val));
+        continue;
+      }
+
+      // exact in IEEE arithmetic.
+      if (N.Op == '+' || N.Op == '*')
+        Equate(C, MakeENode(N.Op, {B, A}));
+      if (N.Op == '*' && G.isNumber(B, 1))
+        Same(C, A);
+      if (N.Op == '*' && G.isNumber(B, 2) && !MayCall(A))
+        Equate(C, MakeENode('+', {A, A})); // strength reduction.
+      if (N.Op == '-' && G.isNumber(B, 0))
+        Same(C, A);
+
+      if (!FastMath)
+        continue;
+
+      if (N.Op == '+' && G.isNumber(B, 0))
+        Same(C, A);
+      // these drop A, so they only apply when it makes no calls; classes made
+      // during this round are assumed to.
+      if (N.Op == '*' && G.isNumber(B, 0) && !MayCall(A))
+        Equate(C, MakeNumberENode(0));
+      if (N.Op == '-' && G.find(A) == G.find(B) && !MayCall(A))
+        Equate(C, MakeNumberENode(0));
+
+      if (N.Op == '+' || N.Op == '*') {
+        // associativity: (a op b) op c -> a op (b op c).
+        for (const ENode &Inner : std::vector<ENode>(G.nodes(G.find(A))))
+          if (Inner.Op == N.Op && !OverBudget())
+            Equate(C, MakeENode(N.Op, {Inner.Children[0],
+                  G.add(MakeENode(N.Op, {Inner.Children[1], B}))}));
+      }
+
+      if (N.Op == '*') {
+        for (const ENode &Inner : std::vector<ENode>(G.nodes(G.find(B)))) {
+          // distributivity: a*(b+c) -> a*b + a*c.
+          if (Inner.Op == '+' && !MayCall(A) && !OverBudget())
+            Equate(C, MakeENode('+', {G.add(MakeENode('*', {A, Inner.Children[0]})),
+                  G.add(MakeENode('*', {A, Inner.Children[1]}))}));
+        }
+        // sqrt(x)*sqrt(x) -> x.
+        if (HaveSqrt && G.find(A) == G.find(B))
+          for (const ENode &Inner : std::vector<ENode>(G.nodes(G.find(A))))
+            if (Inner.Op == 'c' && Inner.Name == "sqrt" && Inner.Children.size() == 1 &&
+                !MayCall(Inner.Children[0]))
+              Same(C, Inner.Children[0]);
+      }
+
+      if (N.Op == '+') {
+        // factoring: a*b + a*c -> a*(b+c). This evaluates a once, not twice.
+        for (const ENode &LM : std::vector<ENode>(G.nodes(G.find(A))))
+          for (const ENode &RM : std::vector<ENode>(G.nodes(G.find(B))))
+            if (LM.Op == '*' && RM.Op == '*' &&
+                G.find(LM.Children[0]) == G.find(RM.Children[0]) &&
+                !MayCall(LM.Children[0]) && !OverBudget())
+              Equate(C, MakeENode('*', {LM.Children[0],
+                    G.add(MakeENode('+', {LM.Children[1], RM.Children[1]}))}));
+      }
+    }
+  }
+  return Changed;
+}
+
+namespace {
+// ECost - critical-path latency in cycles, then instruction count as a tie break.
+struct ECost {
+  double Latency;
+  unsigned Ops;
+  bool operator<(const ECost &O) const {
+    return std::tie(Latency, Ops) < std::tie(O.Latency, O.Ops);
+  }
+};
+}
+
+// NodeLatency - rough latencies of what each node lowers to on current x86.
+static double NodeLatency(const ENode &N) {
+  switch (N.Op) {
+    case 'n':
+    case 'v':
+      return 0;
+    case '<':
+      return 5; // compare plus the conversion back to double.
+    case 'c':
+      return N.Name == "sqrt" ? 15 : N.Name == "pow" ? 40 : 20;
+    default:
+      return 4;
+  }
+}
+
+static std::unique_ptr<ExprAST> ExtractBest(EGraph &G, unsigned C,
+    const std::vector<const ENode *> &Best) {
+  const ENode &N = *Best[G.find(C)];
+  switch (N.Op) {
+    case 'n':
+      return std::make_unique<NumberExprAST>(N.getVal());
+    case 'v':
+      return std::make_unique<VariableExprAST>(N.Name);
+    case 'c': {
+      std::vector<std::unique_ptr<ExprAST>> Args;
+      for (unsigned Child : N.Children)
+        Args.push_back(ExtractBest(G, Child, Best));
+      return std::make_unique<CallExprAST>(N.Name, std::move(Args));
+    }
+    default:
+      return std::make_unique<BinaryExprAST>(N.Op,
+          ExtractBest(G, N.Children[0], Best), ExtractBest(G, N.Children[1], Best));
+  }
+}
+
+// OptimizeWithEGraph - saturate E's e-graph within the iteration, time and
+// size budget, then extract its cheapest equivalent.
+static std::unique_ptr<ExprAST> OptimizeWithEGraph(const ExprAST &E) {
+  EGraph G;
+  unsigned Root = AddToEGraph(G, E);
+
+  auto Deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(EGraphTimeMs);
+  Function *Sqrt = GetFunctionDecl("sqrt");
+  bool HaveSqrt = Sqrt && Sqrt->arg_size() == 1 && !FunctionDefs.count("sqrt");
+  bool LibmPow = !FunctionDefs.count("pow");
+  for (unsigned i = 0; i != EGraphIterations; ++i) {
+    bool Changed = ApplyRewrites(G, LibmPow, HaveSqrt, Deadline);
+    G.rebuild();
+    if (!Changed || G.numNodes() > EGraphMaxNodes ||
+        std::chrono::steady_clock::now() > Deadline)
+      break;
+  }
+
+  // costs only ever go down, so iterate to a fixpoint.
+  const ECost Infinite{1e300, ~0u};
+  std::vector<ECost> Cost(G.numClasses(), Infinite);
+  std::vector<const ENode *> Best(G.numClasses(), nullptr);
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned C = 0; C != G.numClasses(); ++C) {
+      if (G.find(C) != C)
+        continue;
+      for (const ENode &N : G.nodes(C)) {
+        ECost NodeCost{0, N.Op == 'n' || N.Op == 'v' ? 0u : 1u};
+        bool Known = true;
+        for (unsigned Child : N.Children) {
+          const ECost &CC = Cost[G.find(Child)];
+          if (!(CC < Infinite)) {
+            Known = false;
+            break;
+          }
+          NodeCost.Latency = std::max(NodeCost.Latency, CC.Latency);
+          NodeCost.Ops += CC.Ops;
+        }
+        if (!Known)
+          continue;
+        NodeCost.Latency += NodeLatency(N);
+        if (NodeCost < Cost[C]) {
+          Cost[C] = NodeCost;
+          Best[C] = &N;
+          Changed = true;
+        }
+      }
+    }
+  }
+  return ExtractBest(G, Root, Best);
+}
+
+// ---------------------------- Single-Pass Compilation. -------------------------
+// The Emit* routines mirror the Parse* routines above, but generate IR through
+// the Builder as each construct is recognized instead of building a tree.
+
+static Value *EmitExpression();
+
+// EmitFailed - set by a semantic error in the construct being emitted. Parsing
+// carries on to the end of the construct, as it does on the AST path, and the
+// function is dropped once the construct is complete.
+static bool EmitFailed = false;
+
+// EmitSemanticError - note a semantic error that has been logged, and stand in
+// for the value that could not be generated so that parsing can go on.
+static Value *EmitSemanticError() {
+  EmitFailed = true;
+  return UndefValue::get(Type::getDoubleTy(*Context));
+}
+
+static Value *EmitNumberExpr() {
+  Value *V = ConstantFP::get(*Context, APFloat(NumVal));
+  getNextToken();
+  return V;
+}
+
+static Value *EmitParenExpr() {
+  getNextToken();
+  Value *V = EmitExpression();
+  if (!V)
+    return nullptr;
+  if (CurTok != ')')
+    return LogErrorV("expected ')'");
+  getNextToken();
+  return V;
+}
+
+static Value *EmitIdentifierExpr() {
+  std::string IdName = IdentifierStr;
+
+  getNextToken(); //consume the identifier string.
+  if (CurTok != '(') {
+    if (Value *V = VariableExprAST(IdName).codegen())
+      return V;
+    return EmitSemanticError();
+  }
+
+  getNextToken(); // consume (
+  std::vector<Value *> ArgsV;
+  if (CurTok != ')')
+    while (true) {
+      if (Value *Arg = EmitExpression())
+        ArgsV.push_back(Arg);
+      else
+        return nullptr;
+
+      if (CurTok == ')')
+        break;
+
+      if (CurTok != ',')
+        return LogErrorV("Expected ')' or ',' in argument list");
+      getNextToken();
+    }
+
+  //eat ')' token.
+  getNextToken();
+  Function *CalleeF = TheModule->getFunction(IdName);
+  if (!CalleeF) {
+    LogError("Unknown function referenced.");
+    return EmitSemanticError();
+  }
+  if (CalleeF->arg_size() != ArgsV.size()) {
+    LogError("Incorrect number of arguments passed.");
+    return EmitSemanticError();
+  }
+  CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  Call->setCallingConv(CalleeF->getCallingConv());
+  return Call;
+}
+
+static Value *EmitPrimary() {
+  switch(CurTok) {
+    default:
+      return LogErrorV("unknown token when expecting an expression.");
+    case tok_identifier:
+      return EmitIdentifierExpr();
+    case tok_number:
+      return EmitNumberExpr();
+    case '(':
+      return EmitParenExpr();
+  }
+}
+
+static Value *EmitBinOp(char Op, Value *L, Value *R) {
+  switch (Op) {
+    case '+':
+      return Builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+      return Builder->CreateFSub(L, R, "subtmp");
+    case '*':
+      return Builder->CreateFMul(L, R, "multmp");
+    case '<':
+      L = Builder->CreateFCmpULT(L, R, "cmptmp");
+      return Builder->CreateUIToFP(L, Type::getDoubleTy(*Context), "booltmp");
+    default:
+      return LogErrorV("invalid binary operator");
+  }
+}
+
+static Value *EmitBinOpRHS(int ExprPrec, Value *LHS) {
+  while (true) {
+    int TokPrec = GetTokPrecedence();
+    if (TokPrec < ExprPrec)
+      return LHS;
+
+    int BinOp = CurTok;
+    getNextToken();    // consume binop.
+
+    Value *RHS = EmitPrimary();
+    if (!RHS)
+      return nullptr;
+
+    int nextPrec = GetTokPrecedence();
+    if (TokPrec < nextPrec) {
+      RHS = EmitBinOpRHS(TokPrec+1, RHS);
+      if (!RHS)
+        return nullptr;
+    }
+    LHS = EmitBinOp(BinOp, LHS, RHS);
+    if (!LHS)
+      return nullptr;
+  }
+}
+
+static Value *EmitExpression() {
+  Value *LHS = EmitPrimary();
+  if (!LHS)
+    return nullptr;
+
+  return EmitBinOpRHS(0, LHS);
+}
+
+static Function *EmitPrototype() {
+  auto Proto = ParsePrototype();
+  if (!Proto)
+    return nullptr;
+  return Proto->codegen();
+}
+
+// EmitFunction - emit F's body straight from the tokens that follow its prototype.
+// On failure EmitFailed says whether the body was consumed; if not, there was a
+// parse error and the caller skips a token.
+static Function *EmitFunction(Function *F, bool Exported) {
+  EmitFailed = false;
+  if (!BeginFunctionBody(F)) {
+    // a redefinition: parse the body anyway, as the AST path does.
+    EmitFailed = ParseExpression() != nullptr;
+    return nullptr;
+  }
+  ApplyExportModel(F, Exported);
+  Value *RetVal = EmitExpression();
+  if (!RetVal)
+    EmitFailed = false;
+  return FinishFunctionBody(F, EmitFailed ? nullptr : RetVal);
+}
+
+static void HandleDefinitionDirect()
+{
+  bool Exported = CurTok == tok_export;
+  if (Exported && getNextToken() != tok_def) {
+    LogError("Expected 'def' after 'export'.");
+    getNextToken();
+    return;
+  }
+  getNextToken(); // consume 'def'.
+  auto Proto = ParsePrototype();
+  if (Proto && CurTok == tok_table) {
+    // the table is filled by interpreting the body's AST, which is never built here.
+    if (ParseTableAnnotation(*Proto)) {
+      LogError("'table' is not supported in single-pass mode.");
+      if (ParseExpression())
+        return;
+    }
+    Proto = nullptr;
+  }
+  Function *F = Proto ? Proto->codegen() : nullptr;
+  if (!F) {
+    // Skip token for error recovery.
+    getNextToken();
+    return;
+  }
+  if ((F = EmitFunction(F, Exported))) {
+    F->print(errs());
+  } else if (!EmitFailed) {
+    // Skip token for error recovery.
+    getNextToken();
+  }
+}
+
+static void HandleExternDirect()
+{
+  getNextToken(); // consume 'extern'.
+  if (Function *F = EmitPrototype()) {
+    F->print(errs());
+  } else {
+    // skip token for error recovery.
+    getNextToken();
+  }
+}
+
+static void HandleConstDefinitionDirect()
+{
+  getNextToken(); // consume 'const'.
+  if (CurTok != tok_identifier) {
+    LogError("Expected constant name after 'const'.");
+    getNextToken();
+    return;
+  }
+  std::string Name = IdentifierStr;
+  getNextToken();
+  if (CurTok != '=') {
+    LogError("Expected '=' in constant definition.");
+    getNextToken();
+    return;
+  }
+  getNextToken(); // consume '='.
+
+  // emit the initializer into a scratch function; the builder folds it to a
+  // ConstantFP when it is a compile-time constant. defs are not interpreted here.
+  Function *Scratch = CreateFunctionDecl("__const_init", {});
+  Function *F = EmitFunction(Scratch, true);
+  if (!F) {
+    // skip token for error recovery.
+    if (!EmitFailed)
+      getNextToken();
+    return;
+  }
+
+  auto *Ret = cast<ReturnInst>(F->getEntryBlock().getTerminator());
+  auto *Val = dyn_cast<ConstantFP>(Ret->getReturnValue());
+  if (Val) {
+    ConstantValues[Name] = Val->getValueAPF().convertToDouble();
+    fprintf(stderr, "Defined const %s = %f\n", Name.c_str(), ConstantValues[Name]);
+  } else {
+    LogError("const initializer is not a compile-time constant.");
+  }
+  F->eraseFromParent();
+}
+
+static void HandleTopLevelExpressionDirect()
+{
+  Function *F = CreateFunctionDecl("", {});
+  if ((F = EmitFunction(F, true))) {
+    F->print(errs());
+  } else if (!EmitFailed) {
+    //skip token for error recovery.
+    getNextToken();
+  }
+}
+
+
+
+// ---------------------------- Batch Compilation. ------------------------------
+
+// InlineBudget - largest callee, in instructions, that the batch inliner inlines (-inline-budget=N).
+// Kaleidoscope defs are mostly one-line expressions, for which the call itself
+// costs about as much as the body.
+static unsigned InlineBudget = 16;
+
+using DefCallGraph = std::map<std::string, std::vector<std::string>>;
+
+// BuildCallGraph - edges from each def to the defs its body calls. Calls to
+// externs are not edges; there is nothing to compile or inline for them.
+static DefCallGraph BuildCallGraph() {
+  DefCallGraph Graph;
+  for (auto &Def : FunctionDefs) {
+    std::vector<std::string> Callees;
+    Def.second->getBody()->collectCallees(Callees);
+    auto &Edges = Graph[Def.first];
+    for (auto &Callee : Callees)
+      if (FunctionDefs.count(ResolveMergedDef(Callee)))
+        Edges.push_back(ResolveMergedDef(Callee));
+  }
+  return Graph;
+}
+
+// EliminateDeadDefs - drop every def that no entry point can reach, from both
+// FunctionDefs and Graph. Entry points are the top-level expressions and the
+// exported defs. Returns the number of defs removed.
+static unsigned EliminateDeadDefs(DefCallGraph &Graph) {
+  std::vector<std::string> Worklist;
+  for (auto &Entry : BatchEntries)
+    Entry->getBody()->collectCallees(Worklist);
+  for (auto &Def : FunctionDefs)
+    if (Def.second->getProto()->isExported())
+      Worklist.push_back(Def.first);
+
+  std::set<std::string> Live;
+  while (!Worklist.empty()) {
+    std::string Name = Worklist.back();
+    Worklist.pop_back();
+    if (!Graph.count(Name) || !Live.insert(Name).second)
+      continue;
+    for (auto &Callee : Graph[Name])
+      Worklist.push_back(Callee);
+  }
+
+  unsigned NumRemoved = 0;
+  for (auto I = FunctionDefs.begin(); I != FunctionDefs.end();) {
+    if (Live.count(I->first)) {
+      ++I;
+      continue;
+    }
+    Graph.erase(I->first);
+    I = FunctionDefs.erase(I);
+    ++NumRemoved;
+  }
+  return NumRemoved;
+}
+
+void NumberExprAST::appendStructure(std::string &Out,
+    const std::map<std::string, unsigned> &) const {
+  // the exact bit pattern, so 0.0 and -0.0 stay distinct.
+  uint64_t Bits;
+  memcpy(&Bits, &Val, sizeof(Bits));
+  Out += "n" + std::to_string(Bits) + ";";
+}
+
+void VariableExprAST::appendStructure(std::string &Out,
+    const std::map<std::string, unsigned> &Params) const {
+  auto Param = Params.find(Name);
+  if (Param != Params.end())
+    Out += "p" + std::to_string(Param->second) + ";";
+  else
+    Out += "v" + Name + ";"; // a const, same value wherever it is named.
+}
+
+void BinaryExprAST::appendStructure(std::string &Out,
+    const std::map<std::string, unsigned> &Params) const {
+  Out += "(";
+  Out += Op;
+  LHS->appendStructure(Out, Params);
+  RHS->appendStructure(Out, Params);
+  Out += ")";
+}
+
+void CallExprAST::appendStructure(std::string &Out,
+    const std::map<std::string, unsigned> &Params) const {
+  Out += "c" + ResolveMergedDef(Callee) + "(";
+  for (auto &Arg : Args)
+    Arg->appendStructure(Out, Params);
+  Out += ")";
+}
+
+// StructureOf - canonical encoding of a def's arity and body.
+static std::string StructureOf(const FunctionAST &Fn) {
+  std::map<std::string, unsigned> Params;
+  const std::vector<std::string> &Args = Fn.getProto()->getArgs();
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    Params[Args[i]] = i;
+
+  std::string Out = std::to_string(Args.size()) + ":";
+  if (Fn.getProto()->hasTable())
+    Out += "t" + std::to_string(Fn.getProto()->getTableLo()) + "," +
+      std::to_string(Fn.getProto()->getTableHi()) + ":";
+  Fn.getBody()->appendStructure(Out, Params);
+  return Out;
+}
+
+// MergeIdenticalDefs - fold defs whose bodies are identical up to argument names
+// into one implementation, recording the rest in MergedDefs. Repeats until
+// nothing changes, since merging callees can make their callers identical.
+// The implementation is an exported def when the group has one, so its C ABI
+// can back aliases for the other exported names, which are appended to
+// MergedExports. Returns the number merged.
+static unsigned MergeIdenticalDefs(std::vector<std::string> &MergedExports) {
+  unsigned NumMerged = 0;
+  while (true) {
+    // structures are taken before anything merges this round; a def calling
+    // one merged below would hash differently afterwards.
+    std::map<std::string, std::string> Structures; // def -> structure.
+    std::unordered_map<std::string, std::string> Impls; // structure -> implementing def.
+    for (auto &Def : FunctionDefs) {
+      const std::string &Structure =
+          Structures.emplace(Def.first, StructureOf(*Def.second)).first->second;
+      auto Impl = Impls.emplace(Structure, Def.first);
+      if (!Impl.second && Def.second->getProto()->isExported() &&
+          !FunctionDefs[Impl.first->second]->getProto()->isExported())
+        Impl.first->second = Def.first;
+    }
+
+    unsigned NumBefore = NumMerged;
+    for (auto I = FunctionDefs.begin(); I != FunctionDefs.end();) {
+      auto Impl = Impls.find(Structures[I->first]);
+      if (Impl == Impls.end() || Impl->second == I->first) {
+        ++I;
+        continue;
+      }
+      MergedDefs[I->first] = Impl->second;
+      if (I->second->getProto()->isExported())
+        MergedExports.push_back(I->first);
+      I = FunctionDefs.erase(I);
+      ++NumMerged;
+    }
+    if (NumMerged == NumBefore)
+      return NumMerged;
+  }
+}
+
+// EmitMergedAliases - exported defs that were merged away still need their
+// symbol, so make each an alias of its (also exported) implementation.
+static void EmitMergedAliases(const std::vector<std::string> &MergedExports) {
+  for (auto &Name : MergedExports) {
+    Function *Impl = TheModule->getFunction(ResolveMergedDef(Name));
+    if (!Impl)
+      continue;
+    if (Function *Decl = TheModule->getFunction(Name)) {
+      // an extern declaration of the same name; route it to the implementation.
+      Decl->replaceAllUsesWith(Impl);
+      Decl->eraseFromParent();
+    }
+    GlobalAlias::create(Function::ExternalLinkage, Name, Impl);
+  }
+}
+
+// SCCFinder - Tarjan's algorithm. SCCs are produced callees-first, which is the
+// bottom-up order the batch compiler wants.
+class SCCFinder {
+  const DefCallGraph &Graph;
+  std::map<std::string, unsigned> Index, LowLink;
+  std::vector<std::string> Stack;
+  std::set<std::string> OnStack;
+  std::vector<std::vector<std::string>> SCCs;
+
+  // visit - the depth-first search from Root. It keeps its own stack of nodes
+  // and the next successor of each, so a long chain of calls cannot overflow
+  // the native one.
+  void visit(const std::string &Root) {
+    std::vector<std::pair<const std::string *, size_t>> Path;
+    auto Enter = [&](const std::string &Node) {
+      unsigned NodeIndex = Index.size();
+      Index[Node] = LowLink[Node] = NodeIndex;
+      Stack.push_back(Node);
+      OnStack.insert(Node);
+      Path.push_back({&Node, 0});
+    };
+
+    Enter(Root);
+    while (!Path.empty()) {
+      const std::string &Node = *Path.back().first;
+      const std::vector<std::string> &Succs = Graph.at(Node);
+      if (Path.back().second != Succs.size()) {
+        const std::string &Succ = Succs[Path.back().second++];
+        if (!Index.count(Succ))
+          Enter(Succ);
+        else if (OnStack.count(Succ))
+          LowLink[Node] = std::min(LowLink[Node], Index[Succ]);
+        continue;
+      }
+
+      Path.pop_back();
+      if (!Path.empty()) {
+        const std::string &Parent = *Path.back().first;
+        LowLink[Parent] = std::min(LowLink[Parent], LowLink[Node]);
+      }
+      if (LowLink[Node] != Index[Node])
+        continue;
+      SCCs.emplace_back();
+      std::string Member;
+      do {
+        Member = Stack.back();
+        Stack.pop_back();
+        OnStack.erase(Member);
+        SCCs.back().push_back(Member);
+      } while (Member != Node);
+    }
+  }
+
+  public:
+    SCCFinder(const DefCallGraph &Graph) : Graph(Graph) {}
+
+    std::vector<std::vector<std::string>> run() {
+      for (auto &Node : Graph)
+        if (!Index.count(Node.first))
+          visit(Node.first);
+      return std::move(SCCs);
+    }
+};
+
+// InlineSmallCallees - inline every call in F to a compiled function outside
+// F's own SCC whose body is within InlineBudget. Callees were compiled (and
+// had their own calls inlined) before F, so this inlines bottom-up.
+static unsigned InlineSmallCallees(Function *F, const std::set<Function *> &SCC) {
+  std::vector<CallInst *> Calls;
+  for (auto &BB : *F)
+    for (auto &I : BB)
+      if (auto *Call = dyn_cast<CallInst>(&I))
+        Calls.push_back(Call);
+
+  unsigned NumInlined = 0;
+  for (CallInst *Call : Calls) {
+    Function *Callee = Call->getCalledFunction();
+    if (!Callee || Callee->isDeclaration() || SCC.count(Callee) ||
+        Callee->getInstructionCount() > InlineBudget)
+      continue;
+    InlineFunctionInfo IFI;
+    if (InlineFunction(*Call, IFI).isSuccess())
+      ++NumInlined;
+  }
+  return NumInlined;
+}
+
+// CompileBatch - drop unreachable defs, merge identical ones, compile the rest
+// SCC by SCC, callees first, then the top-level expressions that use them.
+static void CompileBatch() {
+  DefCallGraph Graph = BuildCallGraph();
+  unsigned NumRemoved = EliminateDeadDefs(Graph);
+  fprintf(stderr, "Batch: removed %u unreachable defs\n", NumRemoved);
+
+  std::vector<std::string> MergedExports;
+  unsigned NumMerged = MergeIdenticalDefs(MergedExports);
+  fprintf(stderr, "Batch: merged %u identical defs\n", NumMerged);
+  if (NumMerged)
+    Graph = BuildCallGraph();
+
+  // declare every def up front so calls inside an SCC resolve, and before any
+  // call exists so the export model can still pick fastcc for them.
+  for (auto &Def : FunctionDefs) {
+    const PrototypeAST *Proto = Def.second->getProto();
+    ApplyExportModel(CreateFunctionDecl(Proto->getName(), Proto->getArgs()),
+        Proto->isExported());
+  }
+
+  auto SCCs = SCCFinder(Graph).run();
+  unsigned NumInlined = 0;
+  for (auto &SCC : SCCs) {
+    std::set<Function *> Members;
+    bool Failed = false;
+    for (auto &Name : SCC) {
+      if (auto *F = FunctionDefs[Name]->codegen())
+        Members.insert(F);
+      else
+        Failed = true;
+    }
+    if (Failed) {
+      // the rest of the SCC calls the def that failed, so drop it all; calls
+      // from later SCCs then fail as unknown functions.
+      for (Function *F : Members) {
+        fprintf(stderr, "Error: %s calls a def that failed to compile.\n",
+            F->getName().str().c_str());
+        F->deleteBody();
+      }
+      for (auto &Name : SCC)
+        if (Function *F = TheModule->getFunction(Name))
+          F->eraseFromParent();
+      continue;
+    }
+    for (Function *F : Members)
+      NumInlined += InlineSmallCallees(F, Members);
+  }
+
+  for (auto &Entry : BatchEntries)
+    if (auto *F = Entry->codegen())
+      NumInlined += InlineSmallCallees(F, {F});
+
+  fprintf(stderr, "Batch: compiled %zu defs in %zu SCCs, inlined %u calls\n",
+      FunctionDefs.size(), SCCs.size(), NumInlined);
+
+  EmitMergedAliases(MergedExports);
+
+  // catch what the AST-level merge cannot see, e.g. bodies that only became
+  // identical after inlining.
+  legacy::PassManager MPM;
+  MPM.add(createMergeFunctionsPass());
+  MPM.run(*TheModule);
+}
+
+// ---------------------------- Split Code Generation. ---------------------------
+
+// CodegenThreads - threads the backend of one large module runs on
+// (-codegen-threads=N). The module is split into that many parts, and each
+// part is compiled to an object of its own.
+static unsigned CodegenThreads = 1;
+
+// SplitMinInstructions - modules smaller than this are compiled whole; copying
+// out the parts would cost more than the backend time it saves.
+static const unsigned SplitMinInstructions = 5000;
+
+// ParallelFor - run Body(0) ... Body(N-1) on up to one thread per core.
+static void ParallelFor(size_t N, const std::function<void(size_t)> &Body) {
+  std::atomic<size_t> Next(0);
+  std::vector<std::thread> Workers;
+  size_t NumThreads = std::min<size_t>(N, std::max(1u, std::thread::hardware_concurrency()));
+  for (size_t t = 0; t != NumThreads; ++t)
+    Workers.emplace_back([&] {
+      for (size_t i; (i = Next++) < N;)
+        Body(i);
+    });
+  for (auto &W : Workers)
+    W.join();
+}
+
+// SplitCodegen - compile M to one object per part in Objects, the parts in
+// parallel. SplitModule cuts M keeping locals together: an internal def goes in
+// the same part as every function that refers to it, so calls that the export
+// model made internal and fastcc stay that way, no symbol changes linkage, and
+// each part compiles to what a single backend would have made of it. Returns
+// false, leaving M to be compiled whole, when it is too small or does not split.
+static bool SplitCodegen(Module &M, std::vector<SmallVector<char, 0>> &Objects) {
+  if (CodegenThreads < 2 || !TheTargetMachine || M.getInstructionCount() < SplitMinInstructions)
+    return false;
+
+  // each part is handed over as bitcode, to be read into a context of its
+  // own: modules sharing a context cannot be compiled at the same time.
+  std::vector<SmallVector<char, 0>> Parts;
+  SplitModule(M, CodegenThreads, [&](std::unique_ptr<Module> Part) {
+    if (Part->getInstructionCount() == 0 && Part->global_empty())
+      return;
+    Parts.emplace_back();
+    raw_svector_ostream OS(Parts.back());
+    WriteBitcodeToFile(*Part, OS);
+  }, /*PreserveLocals=*/true);
+  if (Parts.size() < 2)
+    return false;
+
+  Objects.assign(Parts.size(), {});
+  std::vector<char> Failed(Parts.size());
+  ParallelFor(Parts.size(), [&](size_t i) {
+    orc::ThreadSafeContext TSC = TheContextPool.acquire();
+    auto Part = cantFail(parseBitcodeFile(
+          MemoryBufferRef(StringRef(Parts[i].data(), Parts[i].size()), "part"), *TSC.getContext()));
+    auto TM = CreateHostTargetMachine();
+    raw_svector_ostream OS(Objects[i]);
+    legacy::PassManager PM;
+    Failed[i] = TM->addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile);
+    if (!Failed[i])
+      PM.run(*Part);
+    Part.reset();
+    TheContextPool.release(std::move(TSC));
+  });
+  if (is_contained(Failed, true)) {
+    Objects.clear();
+    return false;
+  }
+  return true;
+}
+
+// ---------------------------- JIT. --------------------------------------------
+
+// SlabRegion - a large reservation that JIT sections are bump-allocated from.
+// Reserved once with MAP_NORESERVE, so untouched pages cost nothing, and
+// 2 MiB aligned with MADV_HUGEPAGE so the kernel can back it with huge pages.
+// Pages below Protected may have been finalized; those from there on are
+// writable. Writers counts objects with sections here that are not finalized.
+struct SlabRegion {
+  uint8_t *Base = nullptr;
+  size_t Size = 0, Used = 0, Protected = 0;
+  unsigned Writers = 0;
+
+  bool reserve(size_t Bytes) {
+    const size_t HugePage = 2 << 20;
+    void *P = mmap(nullptr, Bytes + HugePage, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (P == MAP_FAILED)
+      return false;
+    Base = (uint8_t *)alignTo((uintptr_t)P, HugePage);
+    Size = Bytes;
+#ifdef MADV_HUGEPAGE
+    madvise(Base, Size, MADV_HUGEPAGE);
+#endif
+    return true;
+  }
+
+  uint8_t *allocate(size_t Bytes, size_t Align) {
+    size_t Start = alignTo(Used, std::max<size_t>(Align, 1));
+    if (!Base || Start + Bytes > Size)
+      return nullptr;
+    Used = Start + Bytes;
+    return Base + Start;
+  }
+
+  // release - hand every page back to the kernel and start over.
+  void release() {
+    if (!Used)
+      return;
+    mprotect(Base, alignTo(Used, getpagesize()), PROT_READ | PROT_WRITE);
+    madvise(Base, alignTo(Used, getpagesize()), MADV_DONTNEED);
+    Used = Protected = 0;
+  }
+};
+
+enum SlabKind { SlabHotCode, SlabColdCode, SlabROData, SlabRWData };
+
+static const size_t SlabSizes[] = {512 << 20, 128 << 20, 128 << 20, 128 << 20};
+// SlabProt - what each kind of region is finalized to.
+static const int SlabProt[] = {PROT_READ | PROT_EXEC, PROT_READ | PROT_EXEC, PROT_READ,
+                               PROT_READ | PROT_WRITE};
+
+// CodeSlab - the regions every JIT object is packed into: hot code, cold code
+// (.text.unlikely, see LayoutByProfile), read-only and read-write data. There
+// are two generations of them. New objects go to the Active one; compaction
+// (CompactJITCode) moves the live code out of the other one, which is released
+// as soon as nothing in it is Live.
+static struct {
+  std::mutex Lock;
+  SlabRegion Regions[2][4];
+  size_t Live[2] = {0, 0}; // bytes held by objects that are still loaded.
+  unsigned Active = 0;
+} CodeSlab;
+
+// SlabMemoryManager - RuntimeDyld memory manager for one object, allocating from
+// CodeSlab instead of mapping each section separately. Each object's sections
+// are packed right after the previous object's, on the same page, so a one-line
+// def costs its few dozen bytes and not a page per section. While it loads, the
+// pages it writes are writable again, including the finalized code it shares
+// the first one with; nothing runs JIT code then. finalizeMemory flips them
+// back with one mprotect per region, so no page is ever writable and
+// executable at once, and code stays one contiguous r-x run that the kernel can
+// collapse into huge pages.
+class SlabMemoryManager : public RTDyldMemoryManager {
+  unsigned Gen;
+  size_t Start[4], End[4];
+  // SharedPage - the page this object's sections begin on when it holds
+  // finalized sections of earlier objects and was made writable for ours, or
+  // SIZE_MAX. Protected again should this object never be finalized.
+  size_t SharedPage[4];
+  size_t Bytes = 0; // this object's share of CodeSlab.Live[Gen].
+  bool Finalized = false;
+
+  uint8_t *allocate(SlabKind Kind, uintptr_t Size, unsigned Alignment) {
+    std::lock_guard<std::mutex> L(CodeSlab.Lock);
+    SlabRegion &R = CodeSlab.Regions[Gen][Kind];
+    if (!R.Base && !R.reserve(SlabSizes[Kind]))
+      return nullptr;
+    if (End[Kind] == Start[Kind] && Kind != SlabRWData) {
+      // a split module's objects load while others still wait on their
+      // symbols; finalizing one must not flip a page another is still
+      // writing, so while any is unfinalized, start on a page of our own.
+      if (R.Writers)
+        R.Used = std::min(alignTo(R.Used, getpagesize()), R.Size);
+      Start[Kind] = End[Kind] = R.Used;
+      ++R.Writers;
+    }
+    size_t Before = R.Used;
+    uint8_t *P = R.allocate(Size, Alignment);
+    if (!P)
+      return nullptr;
+    if (Before < R.Protected) {
+      size_t PageStart = alignDown(Before, getpagesize());
+      mprotect(R.Base + PageStart, R.Protected - PageStart, PROT_READ | PROT_WRITE);
+      if (PageStart < Start[Kind])
+        SharedPage[Kind] = PageStart;
+      R.Protected = PageStart;
+    }
+    End[Kind] = R.Used;
+    Bytes += R.Used - Before;
+    CodeSlab.Live[Gen] += R.Used - Before;
+    return P;
+  }
+
+  public:
+    SlabMemoryManager() {
+      std::lock_guard<std::mutex> L(CodeSlab.Lock);
+      Gen = CodeSlab.Active;
+      for (unsigned i = 0; i != 4; ++i) {
+        Start[i] = End[i] = CodeSlab.Regions[Gen][i].Used;
+        SharedPage[i] = SIZE_MAX;
+      }
+    }
+
+    // give the space back when this was the last object loaded, which covers
+    // the throwaway modules of the autotuner, the profiler and top-level
+    // expressions. Anything else stays a hole until compaction.
+    ~SlabMemoryManager() override {
+      std::lock_guard<std::mutex> L(CodeSlab.Lock);
+      for (unsigned i = 0; i != 4; ++i) {
+        SlabRegion &R = CodeSlab.Regions[Gen][i];
+        if (End[i] == Start[i])
+          continue;
+        if (!Finalized && i != SlabRWData) {
+          --R.Writers;
+          if (SharedPage[i] != SIZE_MAX) {
+            mprotect(R.Base + SharedPage[i], getpagesize(), SlabProt[i]);
+            R.Protected = std::max(R.Protected, SharedPage[i] + getpagesize());
+          }
+        }
+        if (R.Used == End[i])
+          R.Used = Start[i];
+      }
+      CodeSlab.Live[Gen] -= Bytes;
+      if (Gen != CodeSlab.Active && CodeSlab.Live[Gen] == 0)
+        for (auto &R : CodeSlab.Regions[Gen])
+          R.release();
+    }
+
+    uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                 unsigned, StringRef SectionName) override {
+      return allocate(SectionName.startswith(".text.unlikely") ? SlabColdCode : SlabHotCode,
+          Size, Alignment);
+    }
+
+    uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned,
+                                 StringRef, bool IsReadOnly) override {
+      return allocate(IsReadOnly ? SlabROData : SlabRWData, Size, Alignment);
+    }
+
+    bool finalizeMemory(std::string *ErrMsg) override {
+      std::lock_guard<std::mutex> L(CodeSlab.Lock);
+      if (Finalized)
+        return false;
+      Finalized = true;
+      for (unsigned i = 0; i != SlabRWData; ++i) {
+        SlabRegion &R = CodeSlab.Regions[Gen][i];
+        if (End[i] == Start[i])
+          continue;
+        --R.Writers;
+        size_t PageStart = alignDown(Start[i], getpagesize());
+        size_t PageEnd = alignTo(End[i], getpagesize());
+        if (mprotect(R.Base + PageStart, PageEnd - PageStart, SlabProt[i])) {
+          if (ErrMsg)
+            *ErrMsg = std::string("mprotect: ") + strerror(errno);
+          return true;
+        }
+        if (i != SlabROData)
+          sys::Memory::InvalidateInstructionCache(R.Base + Start[i], End[i] - Start[i]);
+        R.Protected = std::max(R.Protected, PageEnd);
+      }
+      return false;
+    }
+};
+
+// TheJIT - in-process compiler for running generated code, created on first use.
+// Externs resolve against the symbols of this process, as in the tutorial.
+static std::unique_ptr<orc::LLJIT> TheJIT;
+// LastJITObject - a copy of the last object file TheJIT compiled.
+static std::unique_ptr<MemoryBuffer> LastJITObject;
+
+static orc::LLJIT *GetJIT() {
+  if (TheJIT)
+    return TheJIT.get();
+
+  auto J = orc::LLJITBuilder()
+    .setObjectLinkingLayerCreator([](orc::ExecutionSession &ES, const Triple &) {
+      return std::make_unique<orc::RTDyldObjectLinkingLayer>(ES,
+          [] { return std::make_unique<SlabMemoryManager>(); });
+    })
+    .create();
+  if (!J) {
+    logAllUnhandledErrors(J.takeError(), errs(), "Error: ");
+    return nullptr;
+  }
+  auto Gen = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      (*J)->getDataLayout().getGlobalPrefix());
+  if (!Gen) {
+    logAllUnhandledErrors(Gen.takeError(), errs(), "Error: ");
+    return nullptr;
+  }
+  (*J)->getMainJITDylib().addGenerator(std::move(*Gen));
+  (*J)->getObjTransformLayer().setTransform(
+      [](std::unique_ptr<MemoryBuffer> Obj) -> Expected<std::unique_ptr<MemoryBuffer>> {
+        LastJITObject = MemoryBuffer::getMemBufferCopy(Obj->getBuffer(),
+            Obj->getBufferIdentifier());
+        return Obj;
+      });
+  TheJIT = std::move(*J);
+  return TheJIT.get();
+}
+
+// AddModuleToJIT - add TSM to J under RT. A large module is split and its parts
+// compiled on CodegenThreads threads up front, then loaded one at a time; the
+// JIT's own compiler would run its backend on one thread.
+static Error AddModuleToJIT(orc::LLJIT &J, orc::ResourceTrackerSP RT,
+                            orc::ThreadSafeModule TSM) {
+  std::vector<SmallVector<char, 0>> Objects;
+  if (!TSM.withModuleDo([&](Module &M) { return SplitCodegen(M, Objects); }))
+    return J.addIRModule(RT, std::move(TSM));
+  for (size_t i = 0; i != Objects.size(); ++i)
+    if (Error Err = J.addObjectFile(RT, MemoryBuffer::getMemBufferCopy(
+            StringRef(Objects[i].data(), Objects[i].size()),
+            TSM.getModuleUnlocked()->getModuleIdentifier() + ".part" + std::to_string(i))))
+      return Err;
+  return Error::success();
+}
+
+// DefStubs - with -jit, every def is called through a stub under its own name
+// that points at the current version's code, "name.vN". Redefining a def
+// repoints the stub, after which nothing can reach the old version and its
+// code is released; for the same reason live code can be moved at will.
+static std::unique_ptr<orc::IndirectStubsManager> DefStubs;
+
+// JITDef - the live version of a def. Its object file is kept as the JIT
+// received it, still relocatable, so the code can be loaded again elsewhere:
+// by compaction, or from a session snapshot in another process.
+struct JITDef {
+  orc::ResourceTrackerSP Tracker;
+  unsigned Version = 0;
+  std::shared_ptr<MemoryBuffer> Object;
+};
+
+static std::map<std::string, JITDef> JITDefs;
+
+// DefGeneration - bumped each time a def is redefined, as opposed to defined
+// for the first time.
+static unsigned DefGeneration = 0;
+
+// JITCallCounts - with -jit and -profile-gen, the counter each def's code
+// increments, by def name so that it carries over redefinitions. The code
+// holds the counter's address, so it cannot run in another process.
+// JITExprsRun - the top-level expressions run meanwhile.
+static std::map<std::string, uint64_t> JITCallCounts;
+static unsigned JITExprsRun = 0;
+
+// CompactMinBytes - code heap size below which dead code is not worth compacting.
+static const size_t CompactMinBytes = 1 << 20;
+
+// TakeModule - hand the current module to the JIT and start a fresh one.
+static orc::ThreadSafeModule TakeModule() {
+  orc::ThreadSafeModule TSM(std::move(TheModule), TheContext);
+  TheContextPool.release(std::move(TheContext));
+  InitializeModule();
+  return TSM;
+}
+
+// DefineStub - make sure the def Name has a stub, pointing nowhere until its
+// code is loaded.
+static void DefineStub(orc::LLJIT &J, const std::string &Name) {
+  if (!DefStubs)
+    DefStubs = orc::createLocalIndirectStubsManagerBuilder(J.getTargetTriple())();
+  if (DefStubs->findStub(Name, true))
+    return;
+  cantFail(DefStubs->createStub(Name, 0, JITSymbolFlags::Exported));
+  cantFail(J.getMainJITDylib().define(orc::absoluteSymbols(
+          {{J.mangleAndIntern(Name), DefStubs->findStub(Name, true)}})));
+}
+
+// LoadDefObject - load the object of Def, version Def.Version of the def Name,
+// with a new tracker and point the stub at it.
+static bool LoadDefObject(orc::LLJIT &J, const std::string &Name, JITDef &Def) {
+  std::string Impl = Name + ".v" + std::to_string(Def.Version);
+  auto RT = J.getMainJITDylib().createResourceTracker();
+  if (auto Err = J.addObjectFile(RT,
+        MemoryBuffer::getMemBufferCopy(Def.Object->getBuffer(), Impl))) {
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    return false;
+  }
+  auto Sym = J.lookup(Impl);
+  if (!Sym) {
+    logAllUnhandledErrors(Sym.takeError(), errs(), "Error: ");
+    cantFail(RT->remove());
+    return false;
+  }
+  cantFail(DefStubs->updatePointer(Name, Sym->getAddress()));
+  Def.Tracker = RT;
+  return true;
+}
+
+static void TuneJITDef(Function &F);
+static void ProfileJITDef(Function &F);
+
+// AddDefToJIT - compile the def F, the only function defined in the current
+// module, as a new version behind its stub, and release the old version. If
+// it fails, the old version stays live, and a def never defined gets no stub.
+static bool AddDefToJIT(Function *F) {
+  orc::LLJIT *J = GetJIT();
+  if (!J)
+    return false;
+
+  TuneJITDef(*F);
+  ProfileJITDef(*F);
+  std::string Name = F->getName().str();
+  auto Old = JITDefs.find(Name);
+  JITDef Def;
+  if (Old != JITDefs.end())
+    Def.Version = Old->second.Version;
+  std::string Impl = Name + ".v" + std::to_string(Def.Version + 1);
+  F->setName(Impl);
+
+  auto RT = J->getMainJITDylib().createResourceTracker();
+  if (auto Err = J->addIRModule(RT, TakeModule())) {
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    return false;
+  }
+  auto Sym = J->lookup(Impl);
+  if (!Sym) {
+    logAllUnhandledErrors(Sym.takeError(), errs(), "Error: ");
+    cantFail(RT->remove());
+    return false;
+  }
+
+  DefineStub(*J, Name);
+  cantFail(DefStubs->updatePointer(Name, Sym->getAddress()));
+  if (Old != JITDefs.end())
+    cantFail(Old->second.Tracker->remove());
+  Def.Tracker = RT;
+  DefGeneration += Def.Version != 0;
+  Def.Version++;
+  Def.Object = std::move(LastJITObject);
+  JITDefs[Name] = std::move(Def);
+  return true;
+}
+
+// CompactJITCode - when most of the active code heap is dead, load every live
+// def's object again into the other generation and repoint its stub. The old
+// generation then holds nothing live and is released in full.
+static void CompactJITCode() {
+  size_t Used = 0, Live;
+  {
+    std::lock_guard<std::mutex> L(CodeSlab.Lock);
+    unsigned Other = CodeSlab.Active ^ 1;
+    for (auto &R : CodeSlab.Regions[CodeSlab.Active])
+      Used += R.Used;
+    Live = CodeSlab.Live[CodeSlab.Active];
+    if (Used < CompactMinBytes || Live * 2 > Used || CodeSlab.Live[Other])
+      return;
+    CodeSlab.Active = Other;
+  }
+
+  // nothing runs while we compile, so the stub may point at freed code
+  // between removing the old copy and loading the new one.
+  unsigned NumMoved = 0;
+  for (auto &Def : JITDefs) {
+    cantFail(Def.second.Tracker->remove());
+    NumMoved += LoadDefObject(*TheJIT, Def.first, Def.second);
+  }
+  fprintf(stderr, "JIT: compacted code heap, moved %u defs, %zu KiB used, %zu KiB live\n",
+      NumMoved, Used >> 10, Live >> 10);
+}
+
+// JITDefinition - compile step for a def with -jit.
+static void JITDefinition(Function *F) {
+  AddDefToJIT(F);
+  CompactJITCode();
+}
+
+static void EvaluateOutOfProcess(Function *F);
+
+// JITTopLevelExpr - run the top-level expression F with -jit and print its
+// value. Its code is dropped as soon as it returns.
+static void JITTopLevelExpr(Function *F) {
+  if (NumExecutors) {
+    EvaluateOutOfProcess(F);
+    return;
+  }
+  orc::LLJIT *J = GetJIT();
+  if (!J)
+    return;
+  F->setName("__anon_expr");
+  auto RT = J->getMainJITDylib().createResourceTracker();
+  if (auto Err = J->addIRModule(RT, TakeModule())) {
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    return;
+  }
+  auto Sym = J->lookup("__anon_expr");
+  if (Sym) {
+    double (*FP)() = (double (*)())Sym->getAddress();
+    fprintf(stderr, "Evaluated to %f\n", FP());
+    ++JITExprsRun;
+  } else {
+    logAllUnhandledErrors(Sym.takeError(), errs(), "Error: ");
+  }
+  cantFail(RT->remove());
+  CompactJITCode();
+}
+
+// SaveSession - write everything a later -jit run needs to pick up where this
+// one stops to Path: operator precedences, consts, externs, and each live def's
+// prototype and relocatable object. Code is not saved as it sits in memory;
+// the loading process links the objects again at its own addresses.
+static bool SaveSession(const std::string &Path) {
+  FILE *F = fopen(Path.c_str(), "wb");
+  if (!F) {
+    fprintf(stderr, "Error: could not write %s: %s\n", Path.c_str(), strerror(errno));
+    return false;
+  }
+  fprintf(F, "kaleidoscope-session 1\n");
+  for (auto &Op : BinopPrecedence)
+    if (Op.second > 0)
+      fprintf(F, "binop %d %d\n", Op.first, Op.second);
+  for (auto &Const : ConstantValues)
+    fprintf(F, "const %s %a\n", Const.first.c_str(), Const.second);
+
+  auto PrintProto = [F](const char *Kind, const std::string &Name,
+                        const std::vector<std::string> &Args) {
+    fprintf(F, "%s %s %zu", Kind, Name.c_str(), Args.size());
+    for (auto &Arg : Args)
+      fprintf(F, " %s", Arg.c_str());
+  };
+  for (auto &Extern : ExternProtos)
+    if (!JITDefs.count(Extern.first)) {
+      PrintProto("extern", Extern.first, Extern.second->getArgs());
+      fprintf(F, "\n");
+    }
+  for (auto &Def : JITDefs) {
+    auto FnAST = FunctionDefs.find(Def.first);
+    PrintProto("def", Def.first, FnAST != FunctionDefs.end()
+        ? FnAST->second->getProto()->getArgs()
+        : ExternProtos[Def.first]->getArgs());
+    StringRef Obj = Def.second.Object->getBuffer();
+    fprintf(F, " %u %zu\n", Def.second.Version, Obj.size());
+    fwrite(Obj.data(), 1, Obj.size(), F);
+  }
+  bool Failed = ferror(F);
+  fclose(F);
+  if (Failed) {
+    fprintf(stderr, "Error: could not write %s\n", Path.c_str());
+    return false;
+  }
+  fprintf(stderr, "Saved session with %zu defs to %s\n", JITDefs.size(), Path.c_str());
+  return true;
+}
+
+// LoadSession - restore a session written by SaveSession. Defs come back
+// without their AST, as externs whose code the JIT already has, so they can
+// be called and redefined but are not constant-folded or differentiated.
+static bool LoadSession(const std::string &Path) {
+  orc::LLJIT *J = GetJIT();
+  if (!J)
+    return false;
+  FILE *F = fopen(Path.c_str(), "rb");
+  if (!F) {
+    fprintf(stderr, "Error: could not read %s: %s\n", Path.c_str(), strerror(errno));
+    return false;
+  }
+
+  auto Fail = [&](const char *Msg) {
+    fprintf(stderr, "Error: %s: %s\n", Path.c_str(), Msg);
+    fclose(F);
+    return false;
+  };
+  int Format;
+  if (fscanf(F, "kaleidoscope-session %d\n", &Format) != 1 || Format != 1)
+    return Fail("not a session snapshot");
+
+  auto ReadProto = [F](std::string &Name) -> std::shared_ptr<PrototypeAST> {
+    char Buf[256];
+    unsigned NumArgs;
+    if (fscanf(F, "%255s %u", Buf, &NumArgs) != 2)
+      return nullptr;
+    Name = Buf;
+    std::vector<std::string> Args;
+    for (unsigned i = 0; i != NumArgs; ++i) {
+      if (fscanf(F, "%255s", Buf) != 1)
+        return nullptr;
+      Args.push_back(Buf);
+    }
+    return std::make_shared<PrototypeAST>(Name, std::move(Args));
+  };
+
+  // define every stub before loading any object, since defs call each other.
+  std::vector<std::string> Loaded;
+  char Kind[16];
+  while (fscanf(F, "%15s", Kind) == 1) {
+    std::string Name;
+    if (!strcmp(Kind, "binop")) {
+      int Op, Prec;
+      if (fscanf(F, "%d %d", &Op, &Prec) != 2)
+        return Fail("bad binop entry");
+      BinopPrecedence[Op] = Prec;
+    } else if (!strcmp(Kind, "const")) {
+      char Buf[256];
+      double Val;
+      if (fscanf(F, "%255s %la", Buf, &Val) != 2)
+        return Fail("bad const entry");
+      ConstantValues[Buf] = Val;
+    } else if (!strcmp(Kind, "extern")) {
+      auto Proto = ReadProto(Name);
+      if (!Proto)
+        return Fail("bad extern entry");
+      ExternProtos[Name] = Proto;
+    } else if (!strcmp(Kind, "def")) {
+      auto Proto = ReadProto(Name);
+      unsigned Version;
+      size_t Size;
+      if (!Proto || fscanf(F, "%u %zu", &Version, &Size) != 2 || fgetc(F) != '\n')
+        return Fail("bad def entry");
+      auto Obj = WritableMemoryBuffer::getNewUninitMemBuffer(Size);
+      if (fread(Obj->getBufferStart(), 1, Size, F) != Size)
+        return Fail("truncated object code");
+      ExternProtos[Name] = Proto;
+      DefineStub(*J, Name);
+      JITDef &Def = JITDefs[Name];
+      Def.Version = Version;
+      Def.Object = std::move(Obj);
+      Loaded.push_back(Name);
+    } else {
+      return Fail("unknown entry");
+    }
+  }
+  fclose(F);
+
+  for (auto &Name : Loaded)
+    if (!LoadDefObject(*J, Name, JITDefs[Name]))
+      return false;
+  fprintf(stderr, "Loaded session with %zu defs from %s\n", Loaded.size(), Path.c_str());
+  return true;
+}
+
+// ---------------------------- Executor Pool. -----------------------------------
+// With -executors=N, -jit runs top-level expressions in N child processes
+// rather than in the compiler. Each child is this program started again with
+// -executor=IN,OUT, serving ORC's remote executor protocol over a pair of
+// pipes; the compiler links code into it with JITLink and calls it there. Defs
+// are still compiled and linked in the compiler, which keeps their objects, as
+// for compaction and sessions, and each executor links them in turn. An
+// expression that crashes takes only its executor down, and the next
+// expression gets a fresh one. Expressions do not depend on each other, so each
+// goes to whichever executor is free, and their results print in the order
+// they were entered.
+
+// RunExecutor - the executor side: serve the compiler on InFD and OutFD until
+// it disconnects.
+static int RunExecutor(int InFD, int OutFD) {
+  auto Server = orc::SimpleRemoteEPCServer::Create<orc::FDSimpleRemoteEPCTransport>(
+      [](orc::SimpleRemoteEPCServer::Setup &S) -> Error {
+        S.setDispatcher(std::make_unique<orc::SimpleRemoteEPCServer::ThreadDispatcher>());
+        S.bootstrapSymbols() = orc::SimpleRemoteEPCServer::defaultBootstrapSymbols();
+        S.services().push_back(std::make_unique<orc::rt_bootstrap::SimpleExecutorMemoryManager>());
+        return Error::success();
+      }, InFD, OutFD);
+  if (!Server) {
+    logAllUnhandledErrors(Server.takeError(), errs(), "Error: executor: ");
+    return 1;
+  }
+  if (auto Err = (*Server)->waitForDisconnect()) {
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: executor: ");
+    return 1;
+  }
+  return 0;
+}
+
+// RemoteDef - a def as executors load it: the object of its current version,
+// which defines Impl, and the name that calls to it use.
+struct RemoteDef {
+  std::string Name, Impl;
+  std::shared_ptr<MemoryBuffer> Object;
+};
+
+// EvalJob - one top-level expression on its way through the pool.
+struct EvalJob {
+  SmallVector<char, 0> Object; // the expression and __kal_eval, which runs it.
+  std::shared_ptr<const std::vector<RemoteDef>> Defs; // as of when it was entered.
+  unsigned Generation = 0; // DefGeneration, likewise.
+  std::string Output;
+  bool Done = false;
+};
+
+// Executor - one executor process and the compiler's session with it. Defs go
+// into the current JITDylib and are linked as they turn up. A redefinition needs a new JITDylib: code linked in
+// the old one calls the version it was linked against directly.
+class Executor {
+  pid_t Pid = 0;
+  std::unique_ptr<orc::ExecutionSession> ES;
+  std::unique_ptr<orc::ObjectLinkingLayer> Layer;
+  orc::JITDylib *JD = nullptr; // the names defs are called by, and expressions.
+  orc::JITDylib *ImplJD = nullptr; // the defs' code, under their versioned names.
+  unsigned Generation = 0, NumJDs = 0;
+  std::set<std::string> Loaded; // defs in JD.
+
+  bool start() {
+    // a child must inherit no other executor's pipe ends, or the compiler would
+    // not see end-of-file when that executor dies; executors start one at a
+    // time, and the compiler's ends are close-on-exec. posix_spawn rather than
+    // fork, which in a threaded process can wait on locks other threads hold.
+    static std::mutex SpawnLock;
+    std::lock_guard<std::mutex> L(SpawnLock);
+    int ToChild[2], FromChild[2];
+    if (pipe(ToChild))
+      return false;
+    if (pipe(FromChild)) {
+      close(ToChild[0]);
+      close(ToChild[1]);
+      return false;
+    }
+    fcntl(ToChild[1], F_SETFD, FD_CLOEXEC);
+    fcntl(FromChild[0], F_SETFD, FD_CLOEXEC);
+    std::string Arg = "-executor=" + std::to_string(ToChild[0]) + "," +
+      std::to_string(FromChild[1]);
+    char *Argv[] = {(char *)"kaleidoscope-executor", (char *)Arg.c_str(), nullptr};
+    int Err = posix_spawn(&Pid, "/proc/self/exe", nullptr, nullptr, Argv, environ);
+    close(ToChild[0]);
+    close(FromChild[1]);
+    if (Err) {
+      close(ToChild[1]);
+      close(FromChild[0]);
+      errno = Err;
+      return false;
+    }
+
+    auto EPC = orc::SimpleRemoteEPC::Create<orc::FDSimpleRemoteEPCTransport>(
+        std::make_unique<orc::DynamicThreadPoolTaskDispatcher>(), orc::SimpleRemoteEPC::Setup(),
+        FromChild[0], ToChild[1]);
+    if (!EPC) {
+      logAllUnhandledErrors(EPC.takeError(), errs(), "Error: ");
+      kill(Pid, SIGKILL);
+      waitpid(Pid, nullptr, 0);
+      return false;
+    }
+    ES = std::make_unique<orc::ExecutionSession>(std::move(*EPC));
+    Layer = std::make_unique<orc::ObjectLinkingLayer>(*ES,
+        ES->getExecutorProcessControl().getMemMgr());
+    JD = ImplJD = nullptr;
+    return true;
+  }
+
+  // stop - end the session and reap the process. Returns how it ended.
+  std::string stop() {
+    consumeError(ES->endSession());
+    Layer.reset();
+    ES.reset();
+    int Status = 0;
+    waitpid(Pid, &Status, 0);
+    Pid = 0;
+    if (WIFSIGNALED(Status))
+      return strsignal(WTERMSIG(Status));
+    return "exit status " + std::to_string(WEXITSTATUS(Status));
+  }
+
+  // dead - whether the process is gone, in which case it is reaped and the
+  // session ended, and Why says how it went.
+  bool dead(std::string &Why) {
+    int Status;
+    if (waitpid(Pid, &Status, WNOHANG) != Pid)
+      return false;
+    Why = WIFSIGNALED(Status) ? strsignal(WTERMSIG(Status))
+      : "exit status " + std::to_string(WEXITSTATUS(Status));
+    Pid = 0;
+    ES->setErrorReporter(consumeError);
+    consumeError(ES->endSession());
+    Layer.reset();
+    ES.reset();
+    return true;
+  }
+
+  bool newJITDylibs() {
+    if (JD) {
+      consumeError(ES->removeJITDylib(*JD));
+      consumeError(ES->removeJITDylib(*ImplJD));
+    }
+    std::string Gen = std::to_string(NumJDs++);
+    JD = &ES->createBareJITDylib("gen" + Gen);
+    ImplJD = &ES->createBareJITDylib("impl" + Gen);
+    auto Process = orc::EPCDynamicLibrarySearchGenerator::GetForTargetProcess(*ES);
+    if (!Process) {
+      logAllUnhandledErrors(Process.takeError(), errs(), "Error: ");
+      return false;
+    }
+    JD->addGenerator(std::move(*Process));
+    // calls from one def to another go through the plain names in JD.
+    ImplJD->addToLinkOrder(*JD);
+    Loaded.clear();
+    return true;
+  }
+
+  // linkDefs - add the defs not in JD yet, and link them before any expression
+  // that calls them: code that calls a def through a reexport can be ready to
+  // run while the def's own memory has not been made executable yet.
+  Error linkDefs(const std::vector<RemoteDef> &Defs) {
+    orc::SymbolLookupSet NewImpls;
+    for (auto &Def : Defs) {
+      if (!Loaded.insert(Def.Name).second)
+        continue;
+      auto Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+      if (Error Err = Layer->add(*ImplJD, MemoryBuffer::getMemBufferCopy(
+              Def.Object->getBuffer(), Def.Impl)))
+        return Err;
+      cantFail(JD->define(orc::reexports(*ImplJD,
+              {{ES->intern(Def.Name), {ES->intern(Def.Impl), Flags}}})));
+      NewImpls.add(ES->intern(Def.Impl));
+    }
+    if (NewImpls.empty())
+      return Error::success();
+    return ES->lookup(orc::makeJITDylibSearchOrder(ImplJD), NewImpls).takeError();
+  }
+
+  public:
+    ~Executor() {
+      if (ES)
+        stop();
+    }
+
+    // evaluate - run Job's expression; returns the line to print for it.
+    std::string evaluate(EvalJob &Job) {
+      if (!ES && !start())
+        return std::string("Error: could not start an executor: ") + strerror(errno) + "\n";
+      if (!JD || Generation != Job.Generation) {
+        if (!newJITDylibs())
+          return "Error: could not set up the executor\n";
+        Generation = Job.Generation;
+      }
+      std::string Why;
+      if (Error Err = linkDefs(*Job.Defs)) {
+        std::string Msg = toString(std::move(Err));
+        if (dead(Why))
+          return "Error: executor died (" + Why + "); the next expression gets a new one\n";
+        return "Error: " + Msg + "\n";
+      }
+
+      auto RT = JD->createResourceTracker();
+      if (Error Err = Layer->add(RT, MemoryBuffer::getMemBufferCopy(
+              StringRef(Job.Object.data(), Job.Object.size()), "__kal_eval")))
+        return "Error: " + toString(std::move(Err)) + "\n";
+      auto Sym = ES->lookup({JD}, ES->intern("__kal_eval"));
+      if (!Sym) {
+        std::string Msg = toString(Sym.takeError());
+        consumeError(RT->remove());
+        RT = nullptr; // it must not outlive the session.
+        if (dead(Why))
+          return "Error: executor died (" + Why + "); the next expression gets a new one\n";
+        return "Error: " + Msg + "\n";
+      }
+
+      auto Result = ES->getExecutorProcessControl().callWrapper(
+          orc::ExecutorAddr(Sym->getAddress()), {});
+      if (Result.getOutOfBandError() || Result.size() != sizeof(double)) {
+        // the call only fails if the connection did: the process is exiting.
+        RT = nullptr;
+        ES->setErrorReporter(consumeError); // freeing its memory will fail too.
+        kill(Pid, SIGKILL);
+        return "Error: executor died (" + stop() + ") evaluating the expression; "
+          "the next one gets a new executor\n";
+      }
+      consumeError(RT->remove());
+      double Val;
+      memcpy(&Val, Result.data(), sizeof(double));
+      char Buf[64];
+      snprintf(Buf, sizeof(Buf), "Evaluated to %f\n", Val);
+      return Buf;
+    }
+};
+
+// ExecutorPool - hands expressions to a worker per executor, and prints the
+// results in the order the expressions came in.
+class ExecutorPool {
+  std::mutex Lock;
+  std::condition_variable Changed;
+  std::deque<std::shared_ptr<EvalJob>> Queue; // waiting for an executor.
+  std::deque<std::shared_ptr<EvalJob>> Pending; // not printed yet.
+  std::vector<std::thread> Workers;
+  bool Finishing = false;
+
+  void work() {
+    Executor E;
+    std::unique_lock<std::mutex> L(Lock);
+    while (true) {
+      Changed.wait(L, [&] { return Finishing || !Queue.empty(); });
+      if (Queue.empty())
+        return;
+      std::shared_ptr<EvalJob> Job = Queue.front();
+      Queue.pop_front();
+      L.unlock();
+      std::string Output = E.evaluate(*Job);
+      L.lock();
+      Job->Output = std::move(Output);
+      Job->Done = true;
+      while (!Pending.empty() && Pending.front()->Done) {
+        fputs(Pending.front()->Output.c_str(), stderr);
+        Pending.pop_front();
+      }
+    }
+  }
+
+  public:
+    void submit(std::shared_ptr<EvalJob> Job) {
+      std::lock_guard<std::mutex> L(Lock);
+      if (Workers.empty()) {
+        // a dead executor must not take the compiler with it on the next write.
+        signal(SIGPIPE, SIG_IGN);
+        for (unsigned i = 0; i != NumExecutors; ++i)
+          Workers.emplace_back([this] { work(); });
+      }
+      Queue.push_back(Job);
+      Pending.push_back(std::move(Job));
+      Changed.notify_one();
+    }
+
+    // finish - wait for every expression submitted, then stop the executors.
+    void finish() {
+      {
+        std::lock_guard<std::mutex> L(Lock);
+        Finishing = true;
+        Changed.notify_all();
+      }
+      for (auto &W : Workers)
+        W.join();
+      Workers.clear();
+    }
+};
+
+static ExecutorPool TheExecutorPool;
+
+// EvaluateOutOfProcess - compile the top-level expression F, with a wrapper
+// function the executor can call, and queue it on TheExecutorPool along with
+// the defs as they are now.
+static void EvaluateOutOfProcess(Function *F) {
+  F->setName("__anon_expr");
+
+  // __kal_eval is an ORC wrapper function: it takes serialized arguments,
+  // here none, and returns its result inline as CWrapperFunctionResult, a
+  // pointer-sized buffer and its size, which fits the double's bits.
+  Type *I64 = Type::getInt64Ty(*Context);
+  StructType *ResultTy = StructType::get(I64, I64);
+  Function *Wrapper = Function::Create(
+      FunctionType::get(ResultTy, {Type::getInt8PtrTy(*Context), I64}, false),
+      Function::ExternalLinkage, "__kal_eval", TheModule.get());
+  IRBuilder<> B(BasicBlock::Create(*Context, "entry", Wrapper));
+  Value *Result = B.CreateInsertValue(UndefValue::get(ResultTy),
+      B.CreateBitCast(B.CreateCall(F), I64), 0);
+  B.CreateRet(B.CreateInsertValue(Result, ConstantInt::get(I64, sizeof(double)), 1));
+
+  auto Job = std::make_shared<EvalJob>();
+  raw_svector_ostream OS(Job->Object);
+  legacy::PassManager PM;
+  if (TheTargetMachine->addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile)) {
+    fprintf(stderr, "Error: the host target cannot emit object files\n");
+    return;
+  }
+  PM.run(*TheModule);
+  TakeModule(); // the object is all the executor needs.
+
+  // a def with no object to send is left out; an expression that calls it
+  // fails to link in the executor, which reports the missing symbol.
+  auto Defs = std::make_shared<std::vector<RemoteDef>>();
+  for (auto &Def : JITDefs)
+    if (Def.second.Object)
+      Defs->push_back({Def.first, Def.first + ".v" + std::to_string(Def.second.Version),
+          Def.second.Object});
+  Job->Defs = std::move(Defs);
+  Job->Generation = DefGeneration;
+  TheExecutorPool.submit(std::move(Job));
+}
+
+// ---------------------------- Autotuning. --------------------------------------
+
+// Autotune - time each config below on the exported defs, or every def under
+// -jit, and keep the fastest (-autotune).
+static bool Autotune = false;
+
+// TuningDBPath - where the winners are kept between runs (-tuning-db=FILE). It
+// is read on every run, so tuned defs keep their pipeline without -autotune.
+static std::string TuningDBPath = ".kaleidoscope-tuning";
+
+// TuningConfigs - the function pipelines the autotuner chooses between. The
+// language has no loops yet, so vectorizing means SLP over straight-line code
+// and there is nothing for an unroller to do.
+struct TuningConfig {
+  const char *Name;
+  void (*AddPasses)(legacy::FunctionPassManager &FPM);
+};
+
+static const TuningConfig TuningConfigs[] = {
+  {"none", [](legacy::FunctionPassManager &) {}},
+  {"cse", [](legacy::FunctionPassManager &FPM) {
+    FPM.add(createEarlyCSEPass());
+    FPM.add(createInstructionCombiningPass());
+  }},
+  {"gvn", [](legacy::FunctionPassManager &FPM) {
+    FPM.add(createInstructionCombiningPass());
+    FPM.add(createReassociatePass());
+    FPM.add(createGVNPass());
+    FPM.add(createCFGSimplificationPass());
+  }},
+  {"slp", [](legacy::FunctionPassManager &FPM) {
+    FPM.add(createEarlyCSEPass());
+    FPM.add(createInstructionCombiningPass());
+    FPM.add(createReassociatePass());
+    FPM.add(createGVNPass());
+    FPM.add(createSLPVectorizerPass());
+    FPM.add(createInstructionCombiningPass());
+    FPM.add(createCFGSimplificationPass());
+  }},
+};
+
+static const TuningConfig *FindTuningConfig(const std::string &Name) {
+  for (auto &Config : TuningConfigs)
+    if (Name == Config.Name)
+      return &Config;
+  return nullptr;
+}
+
+// RunTuningConfig - optimize F, and nothing else in its module, with Config.
+static void RunTuningConfig(Function &F, const TuningConfig &Config) {
+  legacy::FunctionPassManager FPM(F.getParent());
+  if (TheTargetMachine) // the vectorizer's cost model needs the real target.
+    FPM.add(createTargetTransformInfoWrapperPass(TheTargetMachine->getTargetIRAnalysis()));
+  Config.AddPasses(FPM);
+  FPM.doInitialization();
+  FPM.run(F);
+  FPM.doFinalization();
+}
+
+// TuningDB - def name -> hash of its structure when tuned, and the winning config.
+static std::map<std::string, std::pair<uint64_t, std::string>> TuningDB;
+
+// HashBytes / HashStructure - FNV-1a of some bytes, or of StructureOf(Fn).
+// Stable across runs, unlike std::hash, so an entry goes stale exactly when
+// the def's body changes.
+static uint64_t HashBytes(StringRef Bytes, uint64_t Hash = 14695981039346656037ull) {
+  for (unsigned char C : Bytes) {
+    Hash ^= C;
+    Hash *= 1099511628211ull;
+  }
+  return Hash;
+}
+
+static uint64_t HashStructure(const FunctionAST &Fn) {
+  return HashBytes(StructureOf(Fn));
+}
+
+// LoadTuningDB / SaveTuningDB - one "name hash config" line per tuned def.
+static void LoadTuningDB() {
+  FILE *F = fopen(TuningDBPath.c_str(), "r");
+  if (!F)
+    return;
+  char Name[256], Config[64];
+  unsigned long long Hash;
+  while (fscanf(F, "%255s %llx %63s", Name, &Hash, Config) == 3)
+    TuningDB[Name] = {Hash, Config};
+  fclose(F);
+}
+
+static void SaveTuningDB() {
+  FILE *F = fopen(TuningDBPath.c_str(), "w");
+  if (!F) {
+    fprintf(stderr, "Warning: could not write %s: %s\n", TuningDBPath.c_str(), strerror(errno));
+    return;
+  }
+  for (auto &Entry : TuningDB)
+    fprintf(F, "%s %016llx %s\n", Entry.first.c_str(),
+        (unsigned long long)Entry.second.first, Entry.second.second.c_str());
+  fclose(F);
+}
+
+// BenchIterations - calls per timing run; the fastest of BenchRuns runs counts.
+static const unsigned BenchIterations = 100000, BenchRuns = 3;
+// TuningMinGain - the fraction of the default pipeline's time another one must
+// save to be kept; smaller differences are within timing noise.
+static const double TuningMinGain = 0.05;
+
+// TimeConfig - seconds per call of def Name, in a fresh copy of the module read
+// from Bitcode, after optimizing it with Config. Negative if it cannot be run.
+// Spread is how far the slowest run was from the fastest. A loop calls the def
+// with arguments reloaded from memory on every iteration and through a
+// noinline call, the way a caller outside the module would.
+static double TimeConfig(StringRef Bitcode, const std::string &Name,
+                         const TuningConfig &Config, double &Spread) {
+  orc::ThreadSafeContext TSC = TheContextPool.acquire();
+  LLVMContext *Ctx = TSC.getContext();
+  auto M = parseBitcodeFile(MemoryBufferRef(Bitcode, "tuning"), *Ctx);
+  if (!M) {
+    consumeError(M.takeError());
+    TheContextPool.release(std::move(TSC));
+    return -1;
+  }
+  Function *F = (*M)->getFunction(Name);
+  unsigned NumArgs = F->arg_size();
+  RunTuningConfig(*F, Config);
+  // under -jit, Name is already the def's stub.
+  F->setName("__kal_tuned");
+
+  // the JIT needs every definition named; top-level expressions are not.
+  for (auto &G : **M)
+    if (!G.hasName() && !G.isDeclaration())
+      G.setName("__anon_expr");
+
+  Type *DoubleTy = Type::getDoubleTy(*Ctx);
+  Type *I64 = Type::getInt64Ty(*Ctx);
+  Function *Bench = Function::Create(
+      FunctionType::get(DoubleTy, {PointerType::getUnqual(DoubleTy), I64}, false),
+      Function::ExternalLinkage, "__kal_bench", M->get());
+  BasicBlock *Entry = BasicBlock::Create(*Ctx, "entry", Bench);
+  BasicBlock *Loop = BasicBlock::Create(*Ctx, "loop", Bench);
+  BasicBlock *Exit = BasicBlock::Create(*Ctx, "exit", Bench);
+  IRBuilder<> B(Entry);
+  B.CreateBr(Loop);
+
+  B.SetInsertPoint(Loop);
+  PHINode *I = B.CreatePHI(I64, 2, "i");
+  PHINode *Sum = B.CreatePHI(DoubleTy, 2, "sum");
+  std::vector<Value *> Args;
+  for (unsigned i = 0; i != NumArgs; ++i)
+    Args.push_back(B.CreateLoad(DoubleTy,
+          B.CreateConstInBoundsGEP1_64(DoubleTy, Bench->getArg(0), i), /*isVolatile=*/true));
+  CallInst *Call = B.CreateCall(F, Args);
+  Call->setCallingConv(F->getCallingConv());
+  Call->addFnAttr(Attribute::NoInline);
+  Value *NextSum = B.CreateFAdd(Sum, Call);
+  Value *NextI = B.CreateAdd(I, ConstantInt::get(I64, 1));
+  I->addIncoming(ConstantInt::get(I64, 0), Entry);
+  I->addIncoming(NextI, Loop);
+  Sum->addIncoming(ConstantFP::get(DoubleTy, 0.0), Entry);
+  Sum->addIncoming(NextSum, Loop);
+  B.CreateCondBr(B.CreateICmpULT(NextI, Bench->getArg(1)), Loop, Exit);
+
+  B.SetInsertPoint(Exit);
+  B.CreateRet(NextSum);
+
+  orc::LLJIT *J = GetJIT();
+  auto RT = J->getMainJITDylib().createResourceTracker();
+  auto Err = J->addIRModule(RT, orc::ThreadSafeModule(std::move(*M), TSC));
+  TheContextPool.release(std::move(TSC));
+  if (Err) {
+    consumeError(std::move(Err));
+    return -1;
+  }
+
+  double Best = -1, Worst = -1;
+  auto Sym = J->lookup("__kal_bench");
+  if (Sym) {
+    auto *Run = (double (*)(double *, int64_t))Sym->getAddress();
+    std::vector<double> Inputs(NumArgs);
+    for (unsigned i = 0; i != NumArgs; ++i)
+      Inputs[i] = 1.0 + 0.5 * i;
+    Run(Inputs.data(), 1); // fault in the code and whatever it calls.
+    for (unsigned r = 0; r != BenchRuns; ++r) {
+      auto Start = std::chrono::steady_clock::now();
+      Run(Inputs.data(), BenchIterations);
+      std::chrono::duration<double> Elapsed = std::chrono::steady_clock::now() - Start;
+      double PerCall = Elapsed.count() / BenchIterations;
+      if (Best < 0 || PerCall < Best)
+        Best = PerCall;
+      Worst = std::max(Worst, PerCall);
+    }
+    Spread = Worst - Best;
+  } else {
+    consumeError(Sym.takeError());
+  }
+  cantFail(RT->remove());
+  return Best;
+}
+
+// CallsItself - whether Name can reach itself in Graph.
+static bool CallsItself(const DefCallGraph &Graph, const std::string &Name) {
+  std::set<std::string> Seen;
+  std::vector<std::string> Work(Graph.at(Name));
+  while (!Work.empty()) {
+    std::string Def = Work.back();
+    Work.pop_back();
+    if (Def == Name)
+      return true;
+    if (Seen.insert(Def).second)
+      Work.insert(Work.end(), Graph.at(Def).begin(), Graph.at(Def).end());
+  }
+  return false;
+}
+
+// ReachesExtern - whether Name can reach a call to anything but a def, which
+// might have side effects that timing it a few hundred thousand times would
+// repeat.
+static bool ReachesExtern(const std::string &Name) {
+  std::set<std::string> Seen;
+  std::vector<std::string> Work{Name};
+  while (!Work.empty()) {
+    std::string Def = ResolveMergedDef(Work.back());
+    Work.pop_back();
+    auto Fn = FunctionDefs.find(Def);
+    if (Fn == FunctionDefs.end())
+      return true;
+    if (Seen.insert(Def).second)
+      Fn->second->getBody()->collectCallees(Work);
+  }
+  return false;
+}
+
+// AutotuneDef - time every config on the def Name, defined in the module read
+// from Bitcode, unless TuningDB has a current entry for it, and record the
+// fastest. A config other than the default has to win by more than
+// TuningMinGain and by more than the runs' own spread. Recursive defs are
+// skipped, since without conditionals they never return, and so are defs that
+// reach an extern. Returns true if TuningDB changed.
+static bool AutotuneDef(const std::string &Name, StringRef Bitcode,
+                        const DefCallGraph &Graph) {
+  uint64_t Hash = HashStructure(*FunctionDefs[Name]);
+  auto Known = TuningDB.find(Name);
+  if (Known != TuningDB.end() && Known->second.first == Hash)
+    return false;
+  if (CallsItself(Graph, Name)) {
+    fprintf(stderr, "Autotune: %s: skipped, recursive\n", Name.c_str());
+    return false;
+  }
+  if (ReachesExtern(Name)) {
+    fprintf(stderr, "Autotune: %s: skipped, calls an extern\n", Name.c_str());
+    return false;
+  }
+
+  const TuningConfig *Winner = nullptr;
+  double WinnerTime = 0, WinnerSpread = 0, DefaultTime = -1, DefaultSpread = 0;
+  fprintf(stderr, "Autotune: %s:", Name.c_str());
+  for (auto &Config : TuningConfigs) {
+    double Spread = 0;
+    double Time = TimeConfig(Bitcode, Name, Config, Spread);
+    if (Time < 0) {
+      fprintf(stderr, " %s failed", Config.Name);
+      continue;
+    }
+    fprintf(stderr, " %s %.2fns", Config.Name, Time * 1e9);
+    if (&Config == TuningConfigs) {
+      DefaultTime = Time;
+      DefaultSpread = Spread;
+    }
+    if (!Winner || Time < WinnerTime) {
+      Winner = &Config;
+      WinnerTime = Time;
+      WinnerSpread = Spread;
+    }
+  }
+  if (!Winner) {
+    fprintf(stderr, "\n");
+    return false;
+  }
+  if (Winner != TuningConfigs && DefaultTime >= 0 &&
+      DefaultTime - WinnerTime <= std::max(DefaultTime * TuningMinGain,
+                                           DefaultSpread + WinnerSpread))
+    Winner = TuningConfigs;
+  fprintf(stderr, " -> %s\n", Winner->Name);
+  TuningDB[Name] = {Hash, Winner->Name};
+  return true;
+}
+
+// AutotuneDefs - AutotuneDef each exported def in the module. Exported defs
+// stand in for the hot ones: they are what outside callers use. Under -jit the
+// module is empty, and TuneJITDef tunes each def as it is added instead.
+static void AutotuneDefs() {
+  if (UseJIT || !GetJIT())
+    return;
+
+  SmallVector<char, 0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(*TheModule, OS);
+  StringRef BitcodeRef(Bitcode.data(), Bitcode.size());
+
+  DefCallGraph Graph = BuildCallGraph();
+  bool Changed = false;
+  for (auto &Def : FunctionDefs) {
+    if (!Def.second->getProto()->isExported())
+      continue;
+    Function *F = TheModule->getFunction(Def.first);
+    if (F && !F->isDeclaration())
+      Changed |= AutotuneDef(Def.first, BitcodeRef, Graph);
+  }
+  if (Changed)
+    SaveTuningDB();
+}
+
+// ApplyTunedConfig - optimize F, the code of the def Name, with the config
+// TuningDB has a current entry for, if any. Returns true if it did.
+static bool ApplyTunedConfig(const std::string &Name, Function &F) {
+  auto Def = FunctionDefs.find(Name);
+  auto Known = TuningDB.find(Name);
+  if (Def == FunctionDefs.end() || Known == TuningDB.end() ||
+      Known->second.first != HashStructure(*Def->second))
+    return false;
+  const TuningConfig *Config = FindTuningConfig(Known->second.second);
+  if (!Config)
+    return false;
+  RunTuningConfig(F, *Config);
+  return true;
+}
+
+// ApplyTuningDB - ApplyTunedConfig to each def in the module.
+static void ApplyTuningDB() {
+  unsigned NumApplied = 0;
+  for (auto &Def : FunctionDefs) {
+    Function *F = TheModule->getFunction(Def.first);
+    if (F && !F->isDeclaration())
+      NumApplied += ApplyTunedConfig(Def.first, *F);
+  }
+  if (NumApplied)
+    fprintf(stderr, "Applied tuned pipelines to %u defs\n", NumApplied);
+}
+
+// TuneJITDef - with -jit, the module holds just F, the def being added; every
+// def is an entry point there, called from top-level expressions. Tune it if
+// -autotune is on, then optimize it with its recorded config.
+static void TuneJITDef(Function &F) {
+  std::string Name = F.getName().str();
+  if (!FunctionDefs.count(Name))
+    return;
+  if (Autotune) {
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(*F.getParent(), OS);
+    if (AutotuneDef(Name, StringRef(Bitcode.data(), Bitcode.size()), BuildCallGraph()))
+      SaveTuningDB();
+  }
+  if (ApplyTunedConfig(Name, F))
+    fprintf(stderr, "Applied tuned pipeline to %s\n", Name.c_str());
+}
+
+// ---------------------------- Profile-Guided Layout. ---------------------------
+
+// ProfileGenPath - run the top-level expressions with per-def call counters and
+// write the counts here (-profile-gen=FILE).
+// ProfileUsePath - lay out the module by the counts in this file (-profile-use=FILE).
+static std::string ProfileGenPath, ProfileUsePath;
+
+// ColdRatio - a def called fewer than 1/ColdRatio times as often as the hottest
+// one is moved out of the way along with the never-called ones.
+static const uint64_t ColdRatio = 1000;
+
+// ProfileCounts - the counts read from ProfileUsePath, and the largest of them.
+static std::map<std::string, uint64_t> ProfileCounts;
+static uint64_t ProfileMaxCount = 0;
+
+// JITLayout - how many defs LayOutJITDef put in each of .text.hot and
+// .text.unlikely, and how many the profile did not mention.
+static size_t JITLayout[3];
+
+// LoadProfile - read ProfileUsePath into ProfileCounts.
+static bool LoadProfile() {
+  FILE *In = fopen(ProfileUsePath.c_str(), "r");
+  if (!In) {
+    fprintf(stderr, "Error: could not read %s: %s\n", ProfileUsePath.c_str(), strerror(errno));
+    return false;
+  }
+  char Name[256];
+  unsigned long long Count;
+  while (fscanf(In, "%255s %llu", Name, &Count) == 2) {
+    ProfileCounts[Name] = Count;
+    ProfileMaxCount = std::max<uint64_t>(ProfileMaxCount, Count);
+  }
+  fclose(In);
+  return true;
+}
+
+// IsHotCount - whether a def called Count times belongs in .text.hot.
+static bool IsHotCount(uint64_t Count) {
+  return Count && Count * ColdRatio >= ProfileMaxCount;
+}
+
+// InstrumentDef - count calls to F, the def Name, in Counter.
+static void InstrumentDef(Function &F, Constant *Counter) {
+  IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+  B.CreateAtomicRMW(AtomicRMWInst::Add, Counter,
+      ConstantInt::get(Type::getInt64Ty(F.getContext()), 1),
+      MaybeAlign(), AtomicOrdering::Monotonic);
+}
+
+// ProfileJITDef - with -jit, F, the def being added, is its own module, so the
+// layout comes down to which section it goes in: the JIT memory manager keeps
+// .text.unlikely apart from the rest. Under -profile-gen, count its calls.
+static void ProfileJITDef(Function &F) {
+  std::string Name = F.getName().str();
+  if (!ProfileGenPath.empty()) {
+    Type *I64 = Type::getInt64Ty(F.getContext());
+    InstrumentDef(F, ConstantExpr::getIntToPtr(
+          ConstantInt::get(I64, (uintptr_t)&JITCallCounts[Name]),
+          PointerType::getUnqual(I64)));
+  }
+  if (ProfileUsePath.empty())
+    return;
+  auto Count = ProfileCounts.find(Name);
+  if (Count == ProfileCounts.end()) {
+    ++JITLayout[2];
+    return;
+  }
+  bool Hot = IsHotCount(Count->second);
+  F.setSection(Hot ? ".text.hot" : ".text.unlikely");
+  F.setEntryCount(Count->second);
+  ++JITLayout[Hot ? 0 : 1];
+}
+
+// WriteProfile - one "name count" line per def to ProfileGenPath.
+static bool WriteProfile(const std::map<std::string, uint64_t> &Counts) {
+  FILE *Out = fopen(ProfileGenPath.c_str(), "w");
+  if (!Out) {
+    fprintf(stderr, "Error: could not write %s: %s\n", ProfileGenPath.c_str(), strerror(errno));
+    return false;
+  }
+  for (auto &Count : Counts)
+    fprintf(Out, "%s %llu\n", Count.first.c_str(), (unsigned long long)Count.second);
+  fclose(Out);
+  return true;
+}
+
+// ReachesCycle - whether calls from F can recurse. Kaleidoscope has no
+// conditionals, so such a call would never return.
+static bool ReachesCycle(Function *F, std::map<Function *, int> &State) {
+  int &S = State[F]; // 0 unvisited, 1 on the DFS stack, 2 done.
+  if (S)
+    return S == 1;
+  S = 1;
+  for (auto &I : instructions(*F))
+    if (auto *Call = dyn_cast<CallInst>(&I))
+      if (auto *Callee = Call->getCalledFunction())
+        if (!Callee->isDeclaration() && ReachesCycle(Callee, State))
+          return true;
+  State[F] = 2;
+  return false;
+}
+
+// GenerateProfile - count calls to every def over a run of the top-level
+// expressions, in a JIT-compiled copy of the module, and write them with
+// WriteProfile. Calls inlined by -batch are not counted; the out-of-line body
+// they would have reached is not what runs. Under -jit the defs counted their
+// own calls as the session ran, and only the counts are left to write.
+static bool GenerateProfile() {
+  if (UseJIT) {
+    if (!WriteProfile(JITCallCounts))
+      return false;
+    fprintf(stderr, "Profile: ran %u expressions, wrote %zu call counts to %s\n",
+        JITExprsRun, JITCallCounts.size(), ProfileGenPath.c_str());
+    return true;
+  }
+  if (!GetJIT())
+    return false;
+
+  SmallVector<char, 0> Bitcode;
+  raw_svector_ostream OS(Bitcode);
+  WriteBitcodeToFile(*TheModule, OS);
+  orc::ThreadSafeContext TSC = TheContextPool.acquire();
+  LLVMContext *Ctx = TSC.getContext();
+  auto M = cantFail(parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), "profile"), *Ctx));
+
+  Type *I64 = Type::getInt64Ty(*Ctx);
+  std::vector<std::string> Defs, Entries;
+  std::map<Function *, int> State;
+  for (auto &F : *M) {
+    if (F.isDeclaration())
+      continue;
+    if (!F.hasName()) {
+      F.setName("__kal_expr." + std::to_string(Entries.size()));
+      if (ReachesCycle(&F, State))
+        fprintf(stderr, "Warning: %s is recursive and was not run\n", F.getName().str().c_str());
+      else
+        Entries.push_back(F.getName().str());
+      continue;
+    }
+    InstrumentDef(F, new GlobalVariable(*M, I64, false, GlobalValue::ExternalLinkage,
+        ConstantInt::get(I64, 0), "__kal_calls." + F.getName()));
+    Defs.push_back(F.getName().str());
+  }
+
+  orc::LLJIT *J = GetJIT();
+  auto RT = J->getMainJITDylib().createResourceTracker();
+  auto Err = AddModuleToJIT(*J, RT, orc::ThreadSafeModule(std::move(M), TSC));
+  TheContextPool.release(std::move(TSC));
+  if (Err) {
+    logAllUnhandledErrors(std::move(Err), errs(), "Error: ");
+    return false;
+  }
+  for (auto &Entry : Entries) {
+    auto Sym = J->lookup(Entry);
+    if (!Sym) {
+      logAllUnhandledErrors(Sym.takeError(), errs(), "Error: ");
+      return false;
+    }
+    ((double (*)())Sym->getAddress())();
+  }
+
+  std::map<std::string, uint64_t> Counts;
+  for (auto &Def : Defs)
+    Counts[Def] = *(const uint64_t *)cantFail(J->lookup("__kal_calls." + Def)).getAddress();
+  cantFail(RT->remove());
+  if (!WriteProfile(Counts))
+    return false;
+  fprintf(stderr, "Profile: ran %zu expressions, wrote %zu call counts to %s\n",
+      Entries.size(), Defs.size(), ProfileGenPath.c_str());
+  return true;
+}
+
+// LayoutByProfile - order the module's functions by ProfileCounts and split
+// them into sections. The hottest def goes first, followed depth-first by its
+// hot callees, hottest first, so each hot call chain is contiguous; then the
+// next hottest def not yet placed, and so on. These functions go in .text.hot.
+// Cold ones go last, in .text.unlikely, which the linker and the JIT memory
+// manager keep away from the hot code. Defs the profile does not mention stay
+// in between, in .text. Under -jit, ProfileJITDef already placed each def as
+// it was added, and only the totals are left to report.
+static void LayoutByProfile() {
+  if (UseJIT) {
+    fprintf(stderr, "Layout: %zu hot, %zu cold, %zu unprofiled defs\n",
+        JITLayout[0], JITLayout[1], JITLayout[2]);
+    return;
+  }
+  std::map<Function *, uint64_t> Counts;
+  for (auto &Count : ProfileCounts)
+    if (Function *F = TheModule->getFunction(Count.first))
+      if (!F->isDeclaration())
+        Counts[F] = Count.second;
+
+  auto IsHot = [&](Function *F) {
+    auto C = Counts.find(F);
+    return C != Counts.end() && IsHotCount(C->second);
+  };
+
+  std::vector<Function *> Hot, Cold, Rest;
+  std::set<Function *> Placed;
+  std::function<void(Function *)> Place = [&](Function *F) {
+    if (!Placed.insert(F).second)
+      return;
+    Hot.push_back(F);
+    std::vector<Function *> Callees;
+    for (auto &I : instructions(*F))
+      if (auto *Call = dyn_cast<CallInst>(&I))
+        if (auto *Callee = Call->getCalledFunction())
+          if (IsHot(Callee))
+            Callees.push_back(Callee);
+    std::stable_sort(Callees.begin(), Callees.end(),
+        [&](Function *A, Function *B) { return Counts[A] > Counts[B]; });
+    for (Function *Callee : Callees)
+      Place(Callee);
+  };
+
+  std::vector<Function *> ByCount; // module order among equals, for a stable layout.
+  for (auto &F : *TheModule)
+    if (IsHot(&F))
+      ByCount.push_back(&F);
+  std::stable_sort(ByCount.begin(), ByCount.end(),
+      [&](Function *A, Function *B) { return Counts[A] > Counts[B]; });
+  for (Function *F : ByCount)
+    Place(F);
+
+  for (auto &F : *TheModule) {
+    if (F.isDeclaration() || Placed.count(&F))
+      continue;
+    if (Counts.count(&F))
+      Cold.push_back(&F);
+    else
+      Rest.push_back(&F);
+  }
+
+  auto &Functions = TheModule->getFunctionList();
+  for (Function *F : Hot) {
+    F->setSection(".text.hot");
+    F->setEntryCount(Counts[F]);
+    Functions.splice(Functions.end(), Functions, F->getIterator());
+  }
+  for (Function *F : Rest)
+    Functions.splice(Functions.end(), Functions, F->getIterator());
+  for (Function *F : Cold) {
+    F->setSection(".text.unlikely");
+    F->setEntryCount(Counts[F]);
+    Functions.splice(Functions.end(), Functions, F->getIterator());
+  }
+  // top-level expressions are not defs, and never in the profile.
+  size_t NumUnprofiled = std::count_if(Rest.begin(), Rest.end(), [](Function *F) {
+    return F->hasName() && F->getName() != "__anon_expr";
+  });
+  fprintf(stderr, "Layout: %zu hot, %zu cold, %zu unprofiled defs\n",
+      Hot.size(), Cold.size(), NumUnprofiled);
+}
+
+// ---------------------------- Object Emission. --------------------------------
+
+// MultiversionTargets - clones made for each exported def, best first. The last
+// one is the fallback every x86-64 machine can run. A clone may use only the
+// features its bit vouches for, so each is baseline x86-64 plus exactly those,
+// always spelled out so none inherits the TargetMachine's; the CPU named only
+// tunes scheduling.
+static const struct {
+  const char *Suffix;
+  const char *Features;
+  const char *TuneCPU;
+  int FeatureBit; // bit in libgcc's __cpu_model.__cpu_features[0], -1 for the fallback.
+} MultiversionTargets[] = {
+  {"avx512", "+avx512f", "skylake-avx512", 15}, // FEATURE_AVX512F
+  {"avx2", "+avx2", "haswell", 10},             // FEATURE_AVX2
+  {"default", "", "generic", -1},
+};
+
+// MultiversionDef - turn the exported def F into an ifunc of the same name whose
+// resolver picks a clone by the running CPU's features, the way clang lowers
+// target_clones. Calls within the module go through the ifunc as well.
+static void MultiversionDef(Function *F) {
+  std::string Name = F->getName().str();
+  F->setName(Name + ".orig");
+
+  std::vector<Function *> Clones;
+  for (auto &Target : MultiversionTargets) {
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(F, VMap);
+    Clone->setName(Name + "." + Target.Suffix);
+    Clone->setLinkage(Function::InternalLinkage);
+    Clone->addFnAttr("target-cpu", "x86-64");
+    Clone->addFnAttr("tune-cpu", Target.TuneCPU);
+    Clone->addFnAttr("target-features", Target.Features);
+    Clones.push_back(Clone);
+  }
+
+  // resolver: initialize libgcc's CPU model, then test feature bits in order.
+  Type *I32 = Type::getInt32Ty(*Context);
+  StructType *CPUModelTy = StructType::get(*Context,
+      {I32, I32, I32, ArrayType::get(I32, 1)});
+  Constant *CPUModel = TheModule->getOrInsertGlobal("__cpu_model", CPUModelTy);
+  FunctionCallee CPUInit = TheModule->getOrInsertFunction("__cpu_indicator_init",
+      Type::getVoidTy(*Context));
+
+  Function *Resolver = Function::Create(FunctionType::get(F->getType(), false),
+      Function::InternalLinkage, Name + ".resolver", TheModule.get());
+  IRBuilder<> RB(BasicBlock::Create(*Context, "entry", Resolver));
+  RB.CreateCall(CPUInit);
+  Value *FeaturesPtr = RB.CreateConstInBoundsGEP2_32(CPUModelTy, CPUModel, 0, 3);
+  Value *Features = RB.CreateLoad(I32,
+      RB.CreateConstInBoundsGEP2_32(ArrayType::get(I32, 1), FeaturesPtr, 0, 0), "features");
+  Value *Chosen = Clones.back();
+  for (size_t i = Clones.size() - 1; i-- != 0;) {
+    Value *Bit = RB.CreateAnd(Features, 1u << MultiversionTargets[i].FeatureBit);
+    Chosen = RB.CreateSelect(RB.CreateIsNotNull(Bit), Clones[i], Chosen);
+  }
+  RB.CreateRet(Chosen);
+
+  GlobalIFunc *IFunc = GlobalIFunc::create(F->getFunctionType(),
+      F->getAddressSpace(), Function::ExternalLinkage, Name, Resolver, TheModule.get());
+  F->replaceAllUsesWith(IFunc);
+  F->eraseFromParent();
+}
+
+// EmitObjectFile - compile the module for the host to an object file at Path.
+static bool EmitObjectFile(const std::string &Path) {
+  if (Multiversion) {
+    if (TheTargetMachine->getTargetTriple().getArch() != Triple::x86_64) {
+      fprintf(stderr, "Warning: -multiversion is only supported on x86-64, ignored\n");
+    } else {
+      std::vector<Function *> Exported;
+      for (auto &F : *TheModule)
+        if (!F.isDeclaration() && F.hasName() && F.hasExternalLinkage())
+          Exported.push_back(&F);
+      for (Function *F : Exported)
+        MultiversionDef(F);
+    }
+  }
+
+  // a split module goes to one object per part: Path, then Path with .1, .2
+  // and so on before its extension. All of them are to be linked.
+  std::vector<SmallVector<char, 0>> Objects;
+  if (SplitCodegen(*TheModule, Objects)) {
+    for (size_t i = 0; i != Objects.size(); ++i) {
+      SmallString<128> PartPath(Path);
+      if (i)
+        sys::path::replace_extension(PartPath,
+            "." + std::to_string(i) + sys::path::extension(Path).str());
+      std::error_code EC;
+      raw_fd_ostream Dest(PartPath, EC, sys::fs::OF_None);
+      if (EC) {
+        fprintf(stderr, "Error: could not open %s: %s\n", PartPath.c_str(), EC.message().c_str());
+        return false;
+      }
+      Dest.write(Objects[i].data(), Objects[i].size());
+      fprintf(stderr, "Wrote %s\n", PartPath.c_str());
+    }
+    return true;
+  }
+
+  std::error_code EC;
+  raw_fd_ostream Dest(Path, EC, sys::fs::OF_None);
+  if (EC) {
+    fprintf(stderr, "Error: could not open %s: %s\n", Path.c_str(), EC.message().c_str());
+    return false;
+  }
+
+  legacy::PassManager PM;
+  if (TheTargetMachine->addPassesToEmitFile(PM, Dest, nullptr, CGFT_ObjectFile)) {
+    fprintf(stderr, "Error: the host target cannot emit object files\n");
+    return false;
+  }
+  PM.run(*TheModule);
+  Dest.flush();
+  fprintf(stderr, "Wrote %s\n", Path.c_str());
+  return true;
+}
+
+// ---------------------------- Projects. ----------------------------------------
+
+// BuildDir - where -project keeps an object file per source file, and the
+// manifest it uses to skip files that need no rebuild (-build-dir=DIR).
+static std::string BuildDir = ".kaleidoscope-build";
+
+// ProjectFile - one file of a -project build.
+struct ProjectFile {
+  std::string Path;
+  std::vector<LexedToken> Tokens;
+  std::vector<std::string> ImportPaths;
+  std::vector<ProjectFile *> Imports;
+  uint64_t ContentHash = 0;
+  uint64_t InterfaceHash = 0; // of what importers compile against: exported prototypes and consts.
+  std::vector<std::shared_ptr<FunctionAST>> Defs, Entries;
+  std::vector<std::shared_ptr<PrototypeAST>> Externs;
+  std::vector<std::pair<std::string, std::shared_ptr<ExprAST>>> Consts;
+  std::map<std::string, double> ConstRefs; // consts of other files it folds, and their values.
+  bool Failed = false;
+
+  // buildPath - where this file's Ext output goes in BuildDir.
+  std::string buildPath(const char *Ext) const {
+    std::string Name = Path;
+    for (char &C : Name)
+      if (!isalnum(C) && C != '.' && C != '-')
+        C = '_';
+    return BuildDir + "/" + Name + Ext;
+  }
+  std::string objectPath() const { return buildPath(".o"); }
+  std::string bitcodePath() const { return buildPath(".bc"); }
+  std::string summaryPath() const { return buildPath(".summary"); }
+};
+
+// ReadProjectFiles - read and lex Root and every file it imports, directly or
+// not. Files are read a wave at a time, in parallel; each wave's imports make
+// up the next.
+static bool ReadProjectFiles(const std::string &Root,
+                             std::vector<std::unique_ptr<ProjectFile>> &Files) {
+  std::map<std::string, ProjectFile *> ByPath;
+  std::vector<std::string> Wave = {Root};
+  ByPath[Root] = nullptr;
+  bool OK = true;
+  while (!Wave.empty()) {
+    std::vector<std::unique_ptr<ProjectFile>> Read(Wave.size());
+    ParallelFor(Wave.size(), [&](size_t i) {
+      auto F = std::make_unique<ProjectFile>();
+      F->Path = Wave[i];
+      auto Buf = MemoryBuffer::getFile(F->Path);
+      if (Buf) {
+        F->ContentHash = HashBytes((*Buf)->getBuffer());
+        lexRange((*Buf)->getBufferStart(), (*Buf)->getBufferEnd(), F->Tokens);
+        StringRef Dir = sys::path::parent_path(F->Path);
+        for (size_t t = 0; t + 1 < F->Tokens.size(); ++t)
+          if (F->Tokens[t].Tok == tok_import && F->Tokens[t + 1].Tok == tok_string)
+            F->ImportPaths.push_back(ResolveImport(Dir, F->Tokens[t + 1].IdentifierStr));
+      } else {
+        fprintf(stderr, "Error: could not read %s: %s\n", F->Path.c_str(),
+            Buf.getError().message().c_str());
+        F->Failed = true;
+      }
+      Read[i] = std::move(F);
+    });
+
+    Wave.clear();
+    for (auto &F : Read) {
+      OK &= !F->Failed;
+      for (auto &Import : F->ImportPaths)
+        if (ByPath.emplace(Import, nullptr).second)
+          Wave.push_back(Import);
+      ByPath[F->Path] = F.get();
+      Files.push_back(std::move(F));
+    }
+  }
+
+  for (auto &F : Files)
+    for (auto &Import : F->ImportPaths)
+      F->Imports.push_back(ByPath[Import]);
+  return OK;
+}
+
+// OrderProjectFiles - Files, each after the files it imports. Fails on a cycle.
+static bool OrderProjectFiles(const std::vector<std::unique_ptr<ProjectFile>> &Files,
+                              std::vector<ProjectFile *> &Order) {
+  std::map<ProjectFile *, int> State; // 0 unvisited, 1 on the DFS stack, 2 done.
+  std::function<bool(ProjectFile *)> Visit = [&](ProjectFile *F) {
+    int &S = State[F];
+    if (S == 1)
+      fprintf(stderr, "Error: %s imports itself through its imports\n", F->Path.c_str());
+    if (S)
+      return S == 2;
+    S = 1;
+    for (ProjectFile *Import : F->Imports)
+      if (!Visit(Import))
+        return false;
+    State[F] = 2;
+    Order.push_back(F);
+    return true;
+  };
+  for (auto &F : Files)
+    if (!Visit(F.get()))
+      return false;
+  return true;
+}
+
+// ParseProjectFile - parse the items of F, keeping them to compile later.
+static void ParseProjectFile(ProjectFile &F) {
+  ParseTokens(std::move(F.Tokens), [&F] {
+    while (CurTok != tok_eof) {
+      std::string Name;
+      switch (CurTok) {
+        case ';':
+          getNextToken();
+          continue;
+        case tok_import:
+          if (ParseImport(Name))
+            continue;
+          break;
+        case tok_def:
+        case tok_export:
+          if (auto Fn = ParseDefinition()) {
+            F.Defs.push_back(std::move(Fn));
+            continue;
+          }
+          break;
+        case tok_extern:
+          if (auto Proto = ParseExtern()) {
+            F.Externs.push_back(std::move(Proto));
+            continue;
+          }
+          break;
+        case tok_const:
+          if (auto Init = ParseConstDefinition(Name)) {
+            F.Consts.push_back({Name, std::move(Init)});
+            continue;
+          }
+          break;
+        case tok_grad:
+          LogError("'grad' is not available with -project.");
+          break;
+        default:
+          if (auto Fn = ParseTopLevelExpr()) {
+            F.Entries.push_back(std::move(Fn));
+            continue;
+          }
+          break;
+      }
+      // skip token for error recovery.
+      F.Failed = true;
+      getNextToken();
+    }
+  });
+}
+
+// LinkProject - make the defs, externs and consts of all files known, in import
+// order, and check the files against each other. Names are global to a
+// project, and a file may call only its own defs and the exported defs of
+// the files it imports, and use only its own consts and those of the files it
+// imports.
+static bool LinkProject(const std::vector<ProjectFile *> &Order) {
+  std::map<std::string, ProjectFile *> DefinedIn, ConstDefinedIn;
+  bool OK = true;
+  for (ProjectFile *F : Order) {
+    for (auto &Def : F->Defs) {
+      const std::string &Name = Def->getProto()->getName();
+      auto Other = DefinedIn.emplace(Name, F);
+      if (!Other.second) {
+        fprintf(stderr, "Error: %s: %s is already defined in %s\n", F->Path.c_str(),
+            Name.c_str(), Other.first->second->Path.c_str());
+        OK = false;
+        continue;
+      }
+      FunctionDefs[Name] = Def;
+    }
+    for (auto &Proto : F->Externs)
+      ExternProtos[Proto->getName()] = Proto;
+    for (auto &Const : F->Consts) {
+      double Val;
+      if (!Const.second->evaluate(Val)) {
+        fprintf(stderr, "Error: %s: const %s is not a compile-time constant\n",
+            F->Path.c_str(), Const.first.c_str());
+        OK = false;
+        continue;
+      }
+      ConstantValues[Const.first] = Val;
+      ConstDefinedIn[Const.first] = F;
+    }
+  }
+
+  for (ProjectFile *F : Order) {
+    std::vector<std::string> Calls;
+    for (auto &Fn : F->Defs)
+      Fn->getBody()->collectCallees(Calls);
+    for (auto &Fn : F->Entries)
+      Fn->getBody()->collectCallees(Calls);
+    for (auto &Callee : std::set<std::string>(Calls.begin(), Calls.end())) {
+      auto Def = DefinedIn.find(Callee);
+      if (Def == DefinedIn.end() || Def->second == F)
+        continue;
+      const char *Problem = nullptr;
+      if (!FunctionDefs[Callee]->getProto()->isExported())
+        Problem = "which does not export it";
+      else if (!is_contained(F->Imports, Def->second))
+        Problem = "which it does not import";
+      if (Problem) {
+        fprintf(stderr, "Error: %s: %s is defined in %s, %s\n", F->Path.c_str(),
+            Callee.c_str(), Def->second->Path.c_str(), Problem);
+        OK = false;
+      }
+    }
+
+    // a parameter hides a const of the same name.
+    std::set<std::string> Variables;
+    auto CollectVariables = [&Variables](const ExprAST &E, const std::vector<std::string> &Params) {
+      std::vector<std::string> Names;
+      E.collectVariables(Names);
+      for (auto &Name : Names)
+        if (!is_contained(Params, Name))
+          Variables.insert(Name);
+    };
+    for (auto &Fn : F->Defs)
+      CollectVariables(*Fn->getBody(), Fn->getProto()->getArgs());
+    for (auto &Fn : F->Entries)
+      CollectVariables(*Fn->getBody(), {});
+    for (auto &Const : F->Consts)
+      CollectVariables(*Const.second, {});
+    for (auto &Name : Variables) {
+      auto Const = ConstDefinedIn.find(Name);
+      if (Const == ConstDefinedIn.end() || Const->second == F)
+        continue;
+      if (!is_contained(F->Imports, Const->second)) {
+        fprintf(stderr, "Error: %s: const %s is defined in %s, which it does not import\n",
+            F->Path.c_str(), Name.c_str(), Const->second->Path.c_str());
+        OK = false;
+        continue;
+      }
+      F->ConstRefs[Name] = ConstantValues[Name];
+    }
+
+    std::string Interface;
+    char Buf[64];
+    for (auto &Def : F->Defs)
+      if (Def->getProto()->isExported())
+        Interface += Def->getProto()->getName() + "/" +
+          std::to_string(Def->getProto()->getArgs().size()) + ";";
+    for (auto &Const : F->Consts) {
+      snprintf(Buf, sizeof(Buf), "%a", ConstantValues[Const.first]);
+      Interface += Const.first + "=" + Buf + ";";
+    }
+    F->InterfaceHash = HashBytes(Interface);
+  }
+  return OK;
+}
+
+// BuildRecord - what a file was last built from: the hash of its contents and
+// the hash of its imports' interfaces and of the consts it folds, which its
+// bitcode and summary depend on, and the hash of everything its object depends
+// on once the thin link has decided what to import into it. A file whose hashes still match, and whose
+// outputs are still there, needs no rebuild.
+struct BuildRecord {
+  uint64_t ContentHash = 0, ImportsHash = 0, BackendHash = 0;
+};
+
+using BuildManifest = std::map<std::string, BuildRecord>;
+
+static BuildManifest LoadManifest() {
+  BuildManifest Manifest;
+  FILE *F = fopen((BuildDir + "/manifest").c_str(), "r");
+  if (!F)
+    return Manifest;
+  unsigned long long Content, Imports, Backend;
+  char Path[4096];
+  while (fscanf(F, "%llx %llx %llx ", &Content, &Imports, &Backend) == 3 &&
+      fgets(Path, sizeof(Path), F)) {
+    Path[strcspn(Path, "\n")] = 0;
+    Manifest[Path] = {Content, Imports, Backend};
+  }
+  fclose(F);
+  return Manifest;
+}
+
+static void SaveManifest(const BuildManifest &Manifest) {
+  FILE *F = fopen((BuildDir + "/manifest").c_str(), "w");
+  if (!F) {
+    fprintf(stderr, "Warning: could not write %s/manifest: %s\n", BuildDir.c_str(), strerror(errno));
+    return;
+  }
+  for (auto &Entry : Manifest)
+    fprintf(F, "%016llx %016llx %016llx %s\n", (unsigned long long)Entry.second.ContentHash,
+        (unsigned long long)Entry.second.ImportsHash,
+        (unsigned long long)Entry.second.BackendHash, Entry.first.c_str());
+  fclose(F);
+}
+
+// ImportsHash - of what F is compiled against from other files: its imports'
+// interfaces, and the value of every const of theirs it folds.
+static uint64_t ImportsHash(const ProjectFile &F) {
+  uint64_t Hash = HashBytes("");
+  for (ProjectFile *Import : F.Imports)
+    Hash = HashBytes(StringRef((const char *)&Import->InterfaceHash, sizeof(uint64_t)), Hash);
+  for (auto &Const : F.ConstRefs) {
+    Hash = HashBytes(Const.first, Hash);
+    Hash = HashBytes(StringRef((const char *)&Const.second, sizeof(double)), Hash);
+  }
+  return Hash;
+}
+
+// DefSummary - what the thin link knows of a def, without reading its IR.
+struct DefSummary {
+  std::string File; // path of the project file defining it.
+  unsigned Size = 0; // instructions, after the def's own passes.
+  bool Exported = false;
+  bool LocallyPure = false; // touches no memory but its own locals and constants; calls aside.
+  bool Pure = false; // LocallyPure, and so is everything it calls; set by the thin link.
+  uint64_t Hash = 0; // of its IR.
+  std::vector<std::string> Callees; // every function it calls, defs and externs alike.
+};
+
+using ProjectSummary = std::map<std::string, DefSummary>;
+
+// SummarizeModule - write a summary line per def in M to F's summary file:
+// name, size, exported, locally pure, hash, then the callees.
+static bool SummarizeModule(Module &M, const ProjectFile &F) {
+  FILE *Out = fopen(F.summaryPath().c_str(), "w");
+  if (!Out) {
+    fprintf(stderr, "Error: could not write %s: %s\n", F.summaryPath().c_str(), strerror(errno));
+    return false;
+  }
+  for (auto &Fn : F.Defs) {
+    Function *Def = M.getFunction(Fn->getProto()->getName());
+    if (!Def || Def->isDeclaration())
+      continue;
+    bool LocallyPure = true;
+    std::set<std::string> Callees;
+    for (auto &I : instructions(*Def)) {
+      if (auto *Call = dyn_cast<CallInst>(&I)) {
+        Function *Callee = Call->getCalledFunction();
+        if (Callee && !Callee->isIntrinsic())
+          Callees.insert(Callee->getName().str());
+        else if (!Callee || !Callee->doesNotAccessMemory())
+          LocallyPure = false;
+        continue;
+      }
+      if (!I.mayReadOrWriteMemory())
+        continue;
+      const Value *Ptr = getLoadStorePointerOperand(&I);
+      Ptr = Ptr ? getUnderlyingObject(Ptr) : nullptr;
+      auto *GV = dyn_cast_or_null<GlobalVariable>(Ptr);
+      if (!(Ptr && isa<AllocaInst>(Ptr)) && !(GV && GV->isConstant() && isa<LoadInst>(I)))
+        LocallyPure = false;
+    }
+
+    std::string IR;
+    raw_string_ostream OS(IR);
+    Def->print(OS);
+    fprintf(Out, "%s %u %d %d %016llx", Def->getName().str().c_str(), Def->getInstructionCount(),
+        Fn->getProto()->isExported(), LocallyPure, (unsigned long long)HashBytes(OS.str()));
+    for (auto &Callee : Callees)
+      fprintf(Out, " %s", Callee.c_str());
+    fprintf(Out, "\n");
+  }
+  fclose(Out);
+  return true;
+}
+
+// LoadSummary - add the defs in F's summary file to Summary.
+static bool LoadSummary(const ProjectFile &F, ProjectSummary &Summary) {
+  auto Buf = MemoryBuffer::getFile(F.summaryPath());
+  if (!Buf) {
+    fprintf(stderr, "Error: could not read %s: %s\n", F.summaryPath().c_str(),
+        Buf.getError().message().c_str());
+    return false;
+  }
+  SmallVector<StringRef, 8> Lines, Fields;
+  (*Buf)->getBuffer().split(Lines, '\n', -1, false);
+  for (StringRef Line : Lines) {
+    Fields.clear();
+    Line.split(Fields, ' ', -1, false);
+    DefSummary &Def = Summary[Fields[0].str()];
+    Def.File = F.Path;
+    Fields[1].getAsInteger(10, Def.Size);
+    Def.Exported = Fields[2] == "1";
+    Def.LocallyPure = Fields[3] == "1";
+    Fields[4].getAsInteger(16, Def.Hash);
+    for (StringRef Callee : makeArrayRef(Fields).drop_front(5))
+      Def.Callees.push_back(Callee.str());
+  }
+  return true;
+}
+
+// CodegenLock - IR generation goes through the Builder and module globals, so
+// files take turns at it. Optimizing and emitting their modules, which is
+// most of the work, runs in parallel.
+static std::mutex CodegenLock;
+
+// CompileProjectFile - compile F to bitcode in BuildDir, and summarize it.
+static bool CompileProjectFile(ProjectFile &F) {
+  std::unique_ptr<Module> M;
+  orc::ThreadSafeContext TSC;
+  {
+    std::lock_guard<std::mutex> L(CodegenLock);
+    InitializeModule();
+    TheModule->setModuleIdentifier(F.Path);
+    TheModule->setSourceFileName(F.Path);
+    for (auto &Fn : F.Defs) {
+      RunASTPasses(*Fn);
+      if (!Fn->codegen())
+        F.Failed = true;
+    }
+    M = std::move(TheModule);
+    TSC = TheContext;
+  }
+
+  if (!F.Entries.empty())
+    fprintf(stderr, "Warning: %s: top-level expressions are not compiled by -project\n",
+        F.Path.c_str());
+
+  if (!F.Failed) {
+    std::error_code EC;
+    raw_fd_ostream Dest(F.bitcodePath(), EC, sys::fs::OF_None);
+    if (EC) {
+      fprintf(stderr, "Error: could not open %s: %s\n", F.bitcodePath().c_str(), EC.message().c_str());
+      F.Failed = true;
+    } else {
+      WriteBitcodeToFile(*M, Dest);
+      F.Failed = !SummarizeModule(*M, F);
+    }
+  }
+  M.reset();
+  TheContextPool.release(std::move(TSC));
+  return !F.Failed;
+}
+
+// BuildProject - compile the Dirty files on a thread pool, each once the files
+// it imports are done.
+static bool BuildProject(const std::vector<ProjectFile *> &Order,
+                         const std::set<ProjectFile *> &Dirty) {
+  std::mutex Lock;
+  std::condition_variable Changed;
+  std::map<ProjectFile *, size_t> Waiting; // imports not built yet.
+  std::map<ProjectFile *, std::vector<ProjectFile *>> Importers;
+  std::deque<ProjectFile *> Ready;
+  for (ProjectFile *F : Order) {
+    Waiting[F] = F->Imports.size();
+    for (ProjectFile *Import : F->Imports)
+      Importers[Import].push_back(F);
+    if (F->Imports.empty())
+      Ready.push_back(F);
+  }
+
+  size_t Remaining = Order.size();
+  bool OK = true;
+  auto Worker = [&] {
+    std::unique_lock<std::mutex> L(Lock);
+    while (true) {
+      Changed.wait(L, [&] { return !Ready.empty() || !Remaining; });
+      if (!Remaining)
+        return;
+      ProjectFile *F = Ready.front();
+      Ready.pop_front();
+      L.unlock();
+      bool Built = !Dirty.count(F) || CompileProjectFile(*F);
+      L.lock();
+      OK &= Built;
+      --Remaining;
+      for (ProjectFile *Importer : Importers[F])
+        if (--Waiting[Importer] == 0)
+          Ready.push_back(Importer);
+      Changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> Workers;
+  size_t NumThreads = std::min<size_t>(Order.size(),
+      std::max(1u, std::thread::hardware_concurrency()));
+  for (size_t t = 0; t != NumThreads; ++t)
+    Workers.emplace_back(Worker);
+  for (auto &W : Workers)
+    W.join();
+  return OK;
+}
+
+// ---------------------------- Thin Linking. -------------------------------------
+// Each file of a -project is optimized on its own, so a call into another file
+// is opaque: it cannot be inlined, and nothing is known about what it touches.
+// The thin link reads every file's summary, never its IR, and decides for each
+// file which defs of other files are worth copying into it, to be inlined there
+// by its backend, and which of the defs it calls are pure. Backends still run a
+// file at a time, in parallel.
+
+// ImportHotMultiplier - how much larger than InlineBudget a def may be and still
+// be imported, when -profile-use marks it hot.
+static const unsigned ImportHotMultiplier = 10;
+
+// ThinLinkResult - for each file, the defs to import into it and the defs of
+// other files it calls that are pure.
+struct ThinLinkResult {
+  std::map<ProjectFile *, std::set<std::string>> Imports, PureCallees;
+};
+
+// ThinLink - work out what to import where. A def from another file is
+// imported, along with the private defs of its own file it calls, if none of
+// them is recursive and each is within InlineBudget, or within
+// ImportHotMultiplier times that if it is hot. Imported defs' calls to other
+// files are considered in turn.
+static ThinLinkResult ThinLink(const std::vector<ProjectFile *> &Order,
+                               ProjectSummary &Summary) {
+  // a def is pure if it and everything it calls are locally pure. Start from
+  // that and take purity away from callers of impure functions until nothing
+  // changes; cycles of pure defs stay pure.
+  for (auto &Def : Summary)
+    Def.second.Pure = Def.second.LocallyPure;
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+    for (auto &Def : Summary)
+      if (Def.second.Pure)
+        for (auto &Callee : Def.second.Callees) {
+          auto C = Summary.find(Callee);
+          if (C == Summary.end() || !C->second.Pure) {
+            Def.second.Pure = false;
+            Changed = true;
+            break;
+          }
+        }
+  }
+
+  std::map<std::string, uint64_t> Counts;
+  uint64_t MaxCount = 0;
+  if (!ProfileUsePath.empty()) {
+    if (FILE *In = fopen(ProfileUsePath.c_str(), "r")) {
+      char Name[256];
+      unsigned long long Count;
+      while (fscanf(In, "%255s %llu", Name, &Count) == 2) {
+        Counts[Name] = Count;
+        MaxCount = std::max<uint64_t>(MaxCount, Count);
+      }
+      fclose(In);
+    } else {
+      fprintf(stderr, "Warning: could not read %s: %s; importing small defs only\n",
+          ProfileUsePath.c_str(), strerror(errno));
+    }
+  }
+
+  DefCallGraph Graph;
+  for (auto &Def : Summary) {
+    auto &Edges = Graph[Def.first];
+    for (auto &Callee : Def.second.Callees)
+      if (Summary.count(Callee))
+        Edges.push_back(Callee);
+  }
+
+  // Importable - whether Name fits the import rules, and if so the private
+  // defs that must come along with it.
+  std::map<std::string, std::unique_ptr<std::set<std::string>>> Importable;
+  auto GetImportable = [&](const std::string &Name) -> const std::set<std::string> * {
+    auto It = Importable.find(Name);
+    if (It != Importable.end())
+      return It->second.get();
+    auto Closure = std::make_unique<std::set<std::string>>();
+    std::vector<std::string> Work = {Name};
+    bool OK = true;
+    while (OK && !Work.empty()) {
+      std::string Def = Work.back();
+      Work.pop_back();
+      if (!Closure->insert(Def).second)
+        continue;
+      const DefSummary &S = Summary[Def];
+      auto C = Counts.find(Def);
+      bool Hot = C != Counts.end() && C->second && C->second * ColdRatio >= MaxCount;
+      OK = S.Size <= InlineBudget * (Hot ? ImportHotMultiplier : 1) && !CallsItself(Graph, Def);
+      for (auto &Callee : Graph[Def])
+        if (!Summary[Callee].Exported)
+          Work.push_back(Callee);
+    }
+    if (!OK)
+      Closure.reset();
+    return (Importable[Name] = std::move(Closure)).get();
+  };
+
+  ThinLinkResult Result;
+  for (ProjectFile *F : Order) {
+    std::set<std::string> &Imports = Result.Imports[F];
+    std::vector<std::string> Work;
+    for (auto &Fn : F->Defs)
+      Work.push_back(Fn->getProto()->getName());
+    std::set<std::string> Seen(Work.begin(), Work.end());
+    while (!Work.empty()) {
+      std::string Def = Work.back();
+      Work.pop_back();
+      auto S = Summary.find(Def);
+      if (S == Summary.end())
+        continue;
+      for (auto &Callee : S->second.Callees) {
+        auto C = Summary.find(Callee);
+        if (C == Summary.end() || C->second.File == F->Path || !Seen.insert(Callee).second)
+          continue;
+        if (C->second.Pure)
+          Result.PureCallees[F].insert(Callee);
+        if (auto *Closure = GetImportable(Callee)) {
+          Imports.insert(Closure->begin(), Closure->end());
+          Work.insert(Work.end(), Closure->begin(), Closure->end());
+        }
+      }
+    }
+  }
+  return Result;
+}
+
+// BackendHash - everything F's object depends on: F itself, the interfaces it
+// was compiled against, the values of other files' consts folded into it, and
+// what the thin link decided for it. Imported defs carry their own folded
+// consts in their IR hashes.
+static uint64_t BackendHash(ProjectFile &F, const ProjectSummary &Summary,
+                            ThinLinkResult &Link) {
+  std::string Key;
+  char Buf[64];
+  snprintf(Buf, sizeof(Buf), "%016llx %016llx;", (unsigned long long)F.ContentHash,
+      (unsigned long long)ImportsHash(F));
+  Key += Buf;
+  for (auto &Const : F.ConstRefs) {
+    snprintf(Buf, sizeof(Buf), "=%a;", Const.second);
+    Key += Const.first + Buf;
+  }
+  for (auto &Name : Link.Imports[&F]) {
+    snprintf(Buf, sizeof(Buf), "=%016llx;", (unsigned long long)Summary.at(Name).Hash);
+    Key += Name + Buf;
+  }
+  for (auto &Name : Link.PureCallees[&F])
+    Key += Name + " pure;";
+  return HashBytes(Key);
+}
+
+// InlineImportedCalls - inline every call to an imported function, including
+// the calls that inlining brings in. The thin link imports no recursive def,
+// so this ends.
+static unsigned InlineImportedCalls(Module &M, const std::set<Function *> &Imported) {
+  std::vector<CallInst *> Work;
+  for (auto &F : M)
+    if (!Imported.count(&F))
+      for (auto &I : instructions(F))
+        if (auto *Call = dyn_cast<CallInst>(&I))
+          if (Imported.count(Call->getCalledFunction()))
+            Work.push_back(Call);
+
+  unsigned NumInlined = 0;
+  while (!Work.empty()) {
+    CallInst *Call = Work.back();
+    Work.pop_back();
+    InlineFunctionInfo IFI;
+    if (!InlineFunction(*Call, IFI).isSuccess())
+      continue;
+    ++NumInlined;
+    for (CallBase *Inlined : IFI.InlinedCallSites)
+      if (auto *Call = dyn_cast<CallInst>(Inlined))
+        if (Imported.count(Call->getCalledFunction()))
+          Work.push_back(Call);
+  }
+  return NumInlined;
+}
+
+// EmitProjectObject - F's backend: load its bitcode, import into it the defs the
+// thin link chose, inline them, tell LLVM which of its callees are pure,
+// optimize the module and emit its object. Imported exported defs are
+// available_externally and imported private ones internal, so neither is
+// emitted unless a call to it is left over.
+static bool EmitProjectObject(ProjectFile &F, const std::map<std::string, ProjectFile *> &ByPath,
+                              const ProjectSummary &Summary, ThinLinkResult &Link,
+                              unsigned &NumInlined) {
+  orc::ThreadSafeContext TSC = TheContextPool.acquire();
+  LLVMContext &Ctx = *TSC.getContext();
+  auto Release = make_scope_exit([&] { TheContextPool.release(std::move(TSC)); });
+
+  auto Load = [&](const ProjectFile &From) -> std::unique_ptr<Module> {
+    auto Buf = MemoryBuffer::getFile(From.bitcodePath());
+    if (!Buf) {
+      fprintf(stderr, "Error: could not read %s: %s\n", From.bitcodePath().c_str(),
+          Buf.getError().message().c_str());
+      return nullptr;
+    }
+    auto M = parseBitcodeFile((*Buf)->getMemBufferRef(), Ctx);
+    if (!M) {
+      fprintf(stderr, "Error: %s: %s\n", From.bitcodePath().c_str(),
+          toString(M.takeError()).c_str());
+      return nullptr;
+    }
+    return std::move(*M);
+  };
+
+  std::unique_ptr<Module> M = Load(F);
+  if (!M)
+    return false;
+
+  std::map<std::string, std::vector<std::string>> ImportsByFile;
+  for (auto &Name : Link.Imports[&F])
+    ImportsByFile[Summary.at(Name).File].push_back(Name);
+  IRMover Mover(*M);
+  for (auto &From : ImportsByFile) {
+    std::unique_ptr<Module> Src = Load(*ByPath.at(From.first));
+    if (!Src)
+      return false;
+    std::vector<GlobalValue *> Values;
+    for (auto &Name : From.second) {
+      Function *Def = Src->getFunction(Name);
+      Def->setLinkage(Summary.at(Name).Exported ? GlobalValue::AvailableExternallyLinkage
+                                                : GlobalValue::InternalLinkage);
+      Values.push_back(Def);
+    }
+    if (Error Err = Mover.move(std::move(Src), Values,
+          [](GlobalValue &, IRMover::ValueAdder) {}, /*IsPerformingImport=*/true)) {
+      fprintf(stderr, "Error: %s: importing from %s: %s\n", F.Path.c_str(),
+          From.first.c_str(), toString(std::move(Err)).c_str());
+      return false;
+    }
+  }
+
+  std::set<Function *> Imported;
+  for (auto &Name : Link.Imports[&F])
+    Imported.insert(M->getFunction(Name));
+  for (auto &Name : Link.PureCallees[&F])
+    if (Function *Callee = M->getFunction(Name)) {
+      Callee->setDoesNotAccessMemory();
+      Callee->setDoesNotThrow();
+    }
+  NumInlined = InlineImportedCalls(*M, Imported);
+
+  legacy::PassManager MPM;
+  MPM.add(createEliminateAvailableExternallyPass());
+  MPM.add(createGlobalDCEPass());
+  MPM.add(createEarlyCSEPass());
+  MPM.add(createInstructionCombiningPass());
+  MPM.add(createCFGSimplificationPass());
+
+  std::error_code EC;
+  raw_fd_ostream Dest(F.objectPath(), EC, sys::fs::OF_None);
+  if (EC) {
+    fprintf(stderr, "Error: could not open %s: %s\n", F.objectPath().c_str(), EC.message().c_str());
+    return false;
+  }
+  auto TM = CreateHostTargetMachine();
+  if (TM->addPassesToEmitFile(MPM, Dest, nullptr, CGFT_ObjectFile)) {
+    fprintf(stderr, "Error: the host target cannot emit object files\n");
+    return false;
+  }
+  MPM.run(*M);
+  return true;
+}
+
+// RunProject - the -project=Root driver: read, parse and check every file Root
+// pulls in, compile the files that are out of date to bitcode and summaries,
+// thin link, then run the backends whose inputs changed and list the objects
+// on standard output, ready for a linker.
+static bool RunProject(const std::string &Root) {
+  std::vector<std::unique_ptr<ProjectFile>> Files;
+  std::vector<ProjectFile *> Order;
+  if (!ReadProjectFiles(ResolveImport(".", Root), Files) || !OrderProjectFiles(Files, Order))
+    return false;
+
+  ParallelFor(Files.size(), [&](size_t i) { ParseProjectFile(*Files[i]); });
+  for (auto &F : Files)
+    if (F->Failed) {
+      fprintf(stderr, "Error: %s has errors\n", F->Path.c_str());
+      return false;
+    }
+  if (!LinkProject(Order))
+    return false;
+
+  if (auto EC = sys::fs::create_directories(BuildDir)) {
+    fprintf(stderr, "Error: could not create %s: %s\n", BuildDir.c_str(), EC.message().c_str());
+    return false;
+  }
+  BuildManifest Manifest = LoadManifest();
+  std::set<ProjectFile *> Dirty;
+  for (ProjectFile *F : Order) {
+    auto Built = Manifest.find(F->Path);
+    if (Built == Manifest.end() || Built->second.ContentHash != F->ContentHash ||
+        Built->second.ImportsHash != ImportsHash(*F) || !sys::fs::exists(F->bitcodePath()) ||
+        !sys::fs::exists(F->summaryPath()))
+      Dirty.insert(F);
+  }
+
+  bool OK = BuildProject(Order, Dirty);
+  ProjectSummary Summary;
+  for (ProjectFile *F : Order)
+    OK = OK && LoadSummary(*F, Summary);
+  if (!OK) {
+    for (ProjectFile *F : Order)
+      if (F->Failed)
+        Manifest.erase(F->Path);
+    SaveManifest(Manifest);
+    return false;
+  }
+
+  ThinLinkResult Link = ThinLink(Order, Summary);
+  std::map<std::string, ProjectFile *> ByPath;
+  std::vector<ProjectFile *> Backends;
+  size_t NumImported = 0, NumPure = 0;
+  for (ProjectFile *F : Order) {
+    ByPath[F->Path] = F;
+    NumImported += Link.Imports[F].size();
+    NumPure += Link.PureCallees[F].size();
+    BuildRecord &Built = Manifest[F->Path];
+    uint64_t Backend = BackendHash(*F, Summary, Link);
+    if (Dirty.count(F) || Built.BackendHash != Backend || !sys::fs::exists(F->objectPath()))
+      Backends.push_back(F);
+    Built = {F->ContentHash, ImportsHash(*F), Backend};
+  }
+
+  std::vector<unsigned> Inlined(Backends.size());
+  std::vector<char> Emitted(Backends.size());
+  ParallelFor(Backends.size(), [&](size_t i) {
+    Emitted[i] = EmitProjectObject(*Backends[i], ByPath, Summary, Link, Inlined[i]);
+  });
+  for (size_t i = 0; i != Backends.size(); ++i)
+    if (!Emitted[i]) {
+      Manifest.erase(Backends[i]->Path);
+      OK = false;
+    }
+  SaveManifest(Manifest);
+
+  fprintf(stderr, "Project: %zu files, %zu compiled, %zu backends run, %zu up to date\n",
+      Order.size(), Dirty.size(), Backends.size(), Order.size() - Backends.size());
+  fprintf(stderr, "Thin link: %zu defs imported, %zu pure callees, %u calls inlined\n",
+      NumImported, NumPure, std::accumulate(Inlined.begin(), Inlined.end(), 0u));
+  if (OK)
+    for (ProjectFile *F : Order)
+      printf("%s\n", F->objectPath().c_str());
+  return OK;
+}
+
+// -------------------------------------------------------------------------------
+
+
+int main(int argc, char **argv) {
+  bool ParallelLex = false, Pipeline = false;
+  std::string ObjectFile, SaveSessionPath, LoadSessionPath, ProjectRoot;
+  for (int i = 1; i != argc; ++i) {
+    std::string Arg = argv[i];
+    if (Arg == "-single-pass")
+      SinglePass = true;
+    else if (Arg == "-parallel-lex")
+      ParallelLex = true;
+    else if (Arg == "-pipeline")
+      Pipeline = true;
+    else if (Arg == "-ffast-math")
+      FastMath = true;
+    else if (Arg == "-poly=estrin")
+      UseEstrin = true;
+    else if (Arg == "-poly=horner")
+      UseEstrin = false;
+    else if (Arg == "-egraph")
+      UseEGraph = true;
+    else if (Arg.rfind("-egraph-iters=", 0) == 0)
+      EGraphIterations = atoi(Arg.c_str() + strlen("-egraph-iters="));
+    else if (Arg.rfind("-egraph-ms=", 0) == 0)
+      EGraphTimeMs = atoi(Arg.c_str() + strlen("-egraph-ms="));
+    else if (Arg.rfind("-emit-obj=", 0) == 0)
+      ObjectFile = Arg.substr(strlen("-emit-obj="));
+    else if (Arg == "-multiversion")
+      Multiversion = true;
+    else if (Arg == "-batch")
+      BatchMode = true;
+    else if (Arg.rfind("-codegen-threads=", 0) == 0)
+      CodegenThreads = std::max(1, atoi(Arg.c_str() + strlen("-codegen-threads=")));
+    else if (Arg.rfind("-executors=", 0) == 0)
+      NumExecutors = atoi(Arg.c_str() + strlen("-executors="));
+    else if (Arg.rfind("-executor=", 0) == 0) {
+      int InFD, OutFD;
+      if (sscanf(Arg.c_str(), "-executor=%d,%d", &InFD, &OutFD) != 2)
+        return 1;
+      return RunExecutor(InFD, OutFD);
+    }
+    else if (Arg == "-jit")
+      UseJIT = true;
+    else if (Arg == "-no-prelude")
+      UsePrelude = false;
+    else if (Arg.rfind("-project=", 0) == 0)
+      ProjectRoot = Arg.substr(strlen("-project="));
+    else if (Arg.rfind("-build-dir=", 0) == 0)
+      BuildDir = Arg.substr(strlen("-build-dir="));
+    else if (Arg.rfind("-save-session=", 0) == 0)
+      SaveSessionPath = Arg.substr(strlen("-save-session="));
+    else if (Arg.rfind("-load-session=", 0) == 0)
+      LoadSessionPath = Arg.substr(strlen("-load-session="));
+    else if (Arg.rfind("-context-reuse=", 0) == 0)
+      ContextReuse = std::max(1, atoi(Arg.c_str() + strlen("-context-reuse=")));
+    else if (Arg.rfind("-inline-budget=", 0) == 0)
+      InlineBudget = atoi(Arg.c_str() + strlen("-inline-budget="));
+    else if (Arg == "-autotune")
+      Autotune = true;
+    else if (Arg.rfind("-tuning-db=", 0) == 0)
+      TuningDBPath = Arg.substr(strlen("-tuning-db="));
+    else if (Arg.rfind("-profile-gen=", 0) == 0)
+      ProfileGenPath = Arg.substr(strlen("-profile-gen="));
+    else if (Arg.rfind("-profile-use=", 0) == 0)
+      ProfileUsePath = Arg.substr(strlen("-profile-use="));
+  }
+
+  if (!ProjectRoot.empty()) {
+    if (SinglePass || ParallelLex || Pipeline || BatchMode || UseJIT || !ObjectFile.empty()) {
+      fprintf(stderr, "Error: -project cannot be combined with -single-pass, -parallel-lex, "
+          "-pipeline, -batch, -jit or -emit-obj\n");
+      return 1;
+    }
+    // files call what they define or import; an implicit prelude would be
+    // compiled into every file that used it.
+    ProjectBuild = true;
+    UsePrelude = false;
+  }
+  if (Pipeline && (SinglePass || ParallelLex)) {
+    fprintf(stderr, "Error: -pipeline cannot be combined with -single-pass or -parallel-lex\n");
+    return 1;
+  }
+  if (BatchMode && SinglePass) {
+    fprintf(stderr, "Error: -batch needs the AST and cannot be combined with -single-pass\n");
+    return 1;
+  }
+  if (UseJIT && (BatchMode || SinglePass || !ObjectFile.empty())) {
+    fprintf(stderr, "Error: -jit cannot be combined with -batch, -single-pass or -emit-obj\n");
+    return 1;
+  }
+  if (!UseJIT && !(SaveSessionPath.empty() && LoadSessionPath.empty())) {
+    fprintf(stderr, "Error: -save-session and -load-session need -jit\n");
+    return 1;
+  }
+  if (!UseJIT && NumExecutors) {
+    fprintf(stderr, "Error: -executors needs -jit\n");
+    return 1;
+  }
+  if (Autotune && SinglePass) {
+    fprintf(stderr, "Error: -autotune needs the AST and cannot be combined with -single-pass\n");
+    return 1;
+  }
+  if (UseJIT && !ProfileGenPath.empty() && (NumExecutors || !SaveSessionPath.empty())) {
+    fprintf(stderr, "Error: -jit -profile-gen counts calls in this process and cannot be "
+        "combined with -executors or -save-session\n");
+    return 1;
+  }
+  LoadTuningDB();
+  if (!ProfileUsePath.empty() && !LoadProfile())
+    return 1;
+
+  if (ParallelLex) {
+    // slurp all of standard input and tokenize it up front.
+    std::string Buf;
+    char Block[1 << 16];
+    size_t N;
+    while ((N = fread(Block, 1, sizeof(Block), stdin)) != 0)
+      Buf.append(Block, N);
+    PreLexedTokens = lexParallel(Buf, std::thread::hardware_concurrency());
+  }
+
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
   BinopPrecedence['-'] = 20;
   BinopPrecedence['*'] = 40;
 
+  // pipelined: a reader thread fills the input ring while this thread lexes and
+  // parses, and compile steps run on their own thread behind a bounded queue.
+  std::thread Reader, Compiler;
+  if (Pipeline) {
+    InputBlocks = std::make_unique<BoundedQueue<std::string>>(16);
+    CompileQueue = std::make_unique<BoundedQueue<std::function<void()>>>(64);
+    Reader = std::thread([] {
+      char Buf[4096];
+      while (true) {
+        ssize_t N = read(STDIN_FILENO, Buf, sizeof(Buf));
+        if (N < 0 && errno == EINTR)
+          continue;
+        if (N <= 0)
+          break;
+        InputBlocks->push(std::string(Buf, N));
+      }
+      InputBlocks->close();
+    });
+    Compiler = std::thread([] {
+      std::function<void()> Step;
+      while (CompileQueue->pop(Step))
+        Step();
+    });
+  }
+
+  if (!InitializeHostTarget() && (!ObjectFile.empty() || ProjectBuild || NumExecutors))
+    return 1;
+  if (ProjectBuild)
+    return RunProject(ProjectRoot) ? 0 : 1;
+  InitializeModule();
+
+  if (!LoadSessionPath.empty() && !LoadSession(LoadSessionPath))
+    return 1;
+
   fprintf(stderr, "ready> ");
   getNextToken();
 
   MainLoop();
+
+  if (Pipeline) {
+    CompileQueue->close();
+    Compiler.join();
+    Reader.join();
+  }
+  if (NumExecutors)
+    TheExecutorPool.finish();
+
+  if (BatchMode)
+    CompileBatch();
+
+  if (!SaveSessionPath.empty() && !SaveSession(SaveSessionPath))
+    return 1;
+
+  if (Autotune)
+    AutotuneDefs();
+  ApplyTuningDB();
+
+  if (!ProfileGenPath.empty() && !GenerateProfile())
+    return 1;
+  if (!ProfileUsePath.empty())
+    LayoutByProfile();
+
+  if (!ObjectFile.empty() && !EmitObjectFile(ObjectFile))
+    return 1;
+
+  // print out all of the generated code.
+  TheModule->print(errs(), nullptr);
   return 0;
 }
 